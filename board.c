@@ -30,6 +30,7 @@ void board_init(void) {
     _RP24R = 10;   // SPI2 data output to RP24
     _RP20R = 8;    // SPI1 clock output to RP20
     _RP21R = 7;    // SPI1 data output to RP21
+    _RP5R = 18;    // OC1 output to RP5, drives C_BLANK
     __builtin_write_OSCCONL(OSCCON | _OSCCON_IOLOCK_MASK);  // lock pin select
 
     _USB1IP = USB_INT_PRIORITY;
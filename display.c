@@ -4,15 +4,80 @@
 #include "display.h"
 #include "ledcol.h"
 #include "ledrow.h"
+#include "nvm.h"
 
-static void display_frequpdate(void);
-static void display_clearholds(route *);
-static void display_row_recalc(row *);
-static void display_setholds(route *);
+#if NVM_GAMMA_SIGLOC >= NVM_DATA_SIGLOC
+#error "Display tables do not fit in the NVM block"
+#endif
+
+#define ROUTE_DARK      0                                   /**< Slot shown on dark holds, always black. */
+#define ROUTE_FIRST     1                                   /**< First route slot. */
+#define ROUTE_END       (ROUTE_FIRST + DISPLAY_MAX_ROUTES)  /**< Past the last route slot. */
+#define BLEND_FIRST     ROUTE_END                           /**< First blend slot. */
+#define ROUTE_SLOTS     (BLEND_FIRST + DISPLAY_MAX_BLENDS)  /**< Slots in the route table. */
+#define ROUTE_BIT(n)    ((display_routemask)1 << ((n) - ROUTE_FIRST))  /**< Mask bit of a route slot. */
+
+#define BATCH_TIMEOUT_TICKS (DISPLAY_BATCH_TIMEOUT * (CLOCK_FREQUENCY / 65536UL))  /**< Timer3 rollovers before a batch times out. */
+#define RAW_TIMEOUT_TICKS   (DISPLAY_RAW_TIMEOUT * (CLOCK_FREQUENCY / 1000) / 65536UL + 1)  /**< Timer3 rollovers, at least DISPLAY_RAW_TIMEOUT ms. */
+
+#define RAW_IDLE        0   /**< No raw frame is being received. */
+#define RAW_FULL        1   /**< Receiving the colors of every hold. */
+#define RAW_MAP         2   /**< Receiving the changed hold bitmap of a delta frame. */
+#define RAW_RUN         3   /**< Receiving the length of a color run. */
+#define RAW_COLOR       4   /**< Receiving the color of a run. */
 
-static void conflict_add(unsigned char, route *);
+static void display_frequpdate(void);
+static void display_tick(void);
+static void display_swap(void);
+static unsigned int display_row_pulses(row *);
+static void process_nextrow(void);
+static void process_pwm(row *);
+static void process_bcm(row *);
+static unsigned int process_pwmlevel(unsigned int);
+static unsigned int process_gatepulses(void);
+static void process_loadrow(row *);
+static void display_clearholds(unsigned int);
+static void display_row_recalc(unsigned int);
+static void display_rows_update(void);
+static void display_setholds(unsigned int);
+static void display_sethold(unsigned int, unsigned int);
+static void display_clearhold(unsigned int, unsigned int);
+static void display_removeroute(unsigned int);
+static unsigned int route_free(void);
+static void fade_capture(void);
+static void fade_hold(void);
+static void route_load(unsigned int, route *);
+static int route_lit(unsigned int, unsigned int);
+static unsigned int route_hold(route *, unsigned int);
+static unsigned int route_index(route *, unsigned int);
+static unsigned int hold_count(unsigned int);
+static void display_animate(void);
+static void animate_set(unsigned int, unsigned char, unsigned char, unsigned char);
+static void animate_free(unsigned int);
+static void animate_start(unsigned int);
+static void animate_step(unsigned int);
+static int animate_lit(unsigned int, unsigned int);
+static void display_route_scale(unsigned int);
+static void display_slot_scale(unsigned int, unsigned int, unsigned int, unsigned int, unsigned int, unsigned int);
+static unsigned int display_slot_max(unsigned int);
+static void display_rebuild(void);
+static void display_loadtranslation(void);
+static void raw_show(void);
+static unsigned int raw_nexthold(void);
+static void xlate_invert(void);
+static unsigned int xlate_mark(unsigned int *, unsigned int);
+static void display_loadgamma(void);
+static unsigned char gamma_lookup(unsigned int, unsigned int);
+static unsigned char gamma_depth(unsigned int);
+
+static void conflict_add(unsigned int, unsigned int);
+static void conflict_update(unsigned int, unsigned int);
 static void conflict_process(void);
-static void conflict_remove(route *);
+
+static void composite_process(void);
+static display_routemask composite_members(unsigned int);
+static unsigned char composite_get(display_routemask);
+static void composite_blend(unsigned int, display_routemask);
 
 static void fifo_get(display_data *);
 static void fifo_put(display_data *);
@@ -21,6 +86,8 @@ static int fifo_empty(void);
 static void fifo_clear(void);
 
 static unsigned int display_enabled;    /**< Display enabled flag. */
+static unsigned int display_mode;       /**< Frame modulation mode. */
+static unsigned int display_nextmode;   /**< Modulation mode to apply at the next swap. */
 static unsigned int blank;              /**< Whether or not there is at least one hold to display. */
 
 static display_data fifo_data[DISPLAY_FIFO_LEN];    /**< FIFO Data buffer. */
@@ -28,11 +95,72 @@ static unsigned int fifo_head;      /**< FIFO head pointer. */
 static unsigned int fifo_count;     /**< FIFO entry count. */
 static unsigned int fifo_misses;    /**< FIFO underrun count. */
 
-static route routes[DISPLAY_MAX_ROUTES];    /**< Routes active on the display. */
-static row rows[DISPLAY_ROWS];              /**< Row data for the display. */
+static unsigned long stats_ticks;           /**< Timer3 rollovers since the stats were read. */
+static unsigned long stats_frames;          /**< Frames generated since the stats were read. */
+static unsigned long stats_isr_cycles;      /**< Cycles spent in the display interrupt. */
+static unsigned long stats_isr_count;       /**< Display interrupts taken. */
+static unsigned int stats_isr_peak;         /**< Longest display interrupt. */
+static unsigned long stats_process_cycles;  /**< Cycles spent building frames. */
+static unsigned long stats_process_count;   /**< display_process() calls that built frames. */
+static unsigned int stats_process_peak;     /**< Longest display_process() call. */
+static unsigned int stats_saturated;        /**< A cycle sum filled up, and stopped counting. */
+
+/** Route table.  Slot 0 is always dark, so the frame generator can look up
+ * every hold without a test. */
+static route routes[ROUTE_END];
+/** Colors shown this scan, by slot.  The blend entries follow the routes,
+ * so rows can point at either. */
+static unsigned char slot_color[ROUTE_SLOTS][3];
+static unsigned char route_layer[ROUTE_END];    /**< Layer priority of each route, higher layers are blended last. */
+static unsigned char route_blend[ROUTE_END];    /**< Blend mode of each route onto the layers below. */
+static unsigned char route_anim[ROUTE_END];     /**< Animation entry of each route, 0 if it has no effect. */
+/** Animation entries.  Entry 0 is shared by every route without an effect,
+ * and is never written after init. */
+static animation anims[DISPLAY_MAX_EFFECTS + 1];
+static row rows[DISPLAY_ROWS];              /**< Row data being edited (back buffer). */
+static row frame[DISPLAY_ROWS];             /**< Row data being scanned out (front buffer). */
+static unsigned int frame_pending;          /**< Back buffer has changed since the last swap. */
+static display_routemask routes_retired;    /**< Route slots hidden, but still in the front buffer. */
+static display_routemask routes_staged;     /**< Route slots holding the next scene. */
+static unsigned char routes_last;           /**< Route slot shown or staged last. */
+static volatile unsigned int batch_open;    /**< Edits are held in the back buffer until commit. */
+static unsigned int batch_ticks;            /**< Timer3 rollovers since the batch was opened. */
+static volatile unsigned int timebase;      /**< Timer3 rollovers, free running and never reset. */
+static unsigned char rows_dirty;            /**< Rows whose summary fields are stale. */
+static unsigned char rows_enabled;          /**< Rows with at least one active hold. */
+static unsigned int rows_pulses;            /**< Timer periods per scan of the back buffer. */
 
 static unsigned int process_activerow;  /**< Active row in output data generator. */
-static unsigned int process_pwmpos;     /**< PWM pulse position. */
+static unsigned int process_pwmpos;     /**< PWM pulse position, or bit plane in BCM mode. */
+static unsigned int process_pulses;     /**< Timer periods of the row being generated. */
+static display_data process_cbuffer;    /**< Frame under construction. */
+static unsigned char process_pwmflag[DISPLAY_COLOR_DEPTH];  /**< PWM positions where a color turns off. */
+static unsigned char process_color[DISPLAY_COLS][3];        /**< Colors of the row being generated. */
+static display_colmask process_on[3];   /**< Columns still lit in each channel of the PWM frame. */
+
+static unsigned char fade_from[DISPLAY_ROWS][DISPLAY_COLS][3];  /**< Colors shown when the crossfade started. */
+static unsigned char fade_max[DISPLAY_ROWS];    /**< Brightest color of each row in fade_from. */
+static unsigned int fade_len;               /**< Scans in the running crossfade, 0 if none. */
+static unsigned int fade_pos;               /**< Scans into the crossfade. */
+
+static unsigned int raw_mode;               /**< Raw frames are scanned out instead of routes. */
+static unsigned int raw_next;               /**< Raw mode to apply at the next swap. */
+static unsigned int raw_pending;            /**< A complete raw frame waits for the swap. */
+static unsigned int raw_state;              /**< What the next received byte is. */
+static unsigned int raw_hold;               /**< Logical hold being received. */
+static unsigned int raw_channel;            /**< Color channel being received. */
+static unsigned int raw_pos;                /**< Bitmap byte being received. */
+static unsigned int raw_run;                /**< Changed holds left in the color run. */
+static unsigned int raw_ticks;              /**< Timebase at the last received byte. */
+static unsigned char raw_color[3];          /**< Color of the run, after the color curves. */
+static unsigned int raw_map[DISPLAY_HOLD_WORDS];    /**< Holds changed by the delta frame. */
+static unsigned char raw_front[DISPLAY_ROWS][DISPLAY_COLS][3];  /**< Raw frame being scanned out. */
+static unsigned char raw_max[DISPLAY_ROWS];    /**< Brightest color of each row in raw_front. */
+
+/** Raw frame being received.  A crossfade never runs while raw frames are
+ * shown, so the frame is received into the crossfade buffer.  Starting a
+ * crossfade drops a frame that is waiting for the swap. */
+static unsigned char (*const raw_back)[DISPLAY_COLS][3] = fade_from;
 
 static unsigned long timer_period;      /**< Display tick period. */
 static unsigned int timer_repeat;       /**< Pattern repeat counter. */
@@ -41,8 +169,99 @@ static unsigned int timer_activerow;    /**< Active output row. */
 static unsigned int hb_pos;             /**< Heartbeat intensity level. */
 static unsigned int hb_fullcount;       /**< Heartbeat counter, used for intensity calculation. */
 
+#if DISPLAY_HOLDS % 16
+#error "The default translation table is built 16 holds at a time"
+#endif
+
+#define XLATE4(l)   DISPLAY_XLATE(l), DISPLAY_XLATE(l + 1), DISPLAY_XLATE(l + 2), DISPLAY_XLATE(l + 3)
+#define XLATE16(l)  XLATE4(l), XLATE4(l + 4), XLATE4(l + 8), XLATE4(l + 12)
+
+/** Logical to physical hold translation table.  Defaults to the stock panel
+ * wiring, and is replaced by the table in NVM when one has been stored. */
+static unsigned char xlate[DISPLAY_HOLDS] __attribute__((aligned(2))) = {
+    XLATE16(0),
+#if DISPLAY_HOLDS > 16
+    XLATE16(16),
+#endif
+#if DISPLAY_HOLDS > 32
+    XLATE16(32),
+#endif
+#if DISPLAY_HOLDS > 48
+    XLATE16(48),
+#endif
+#if DISPLAY_HOLDS > 64
+    XLATE16(64),
+#endif
+#if DISPLAY_HOLDS > 80
+    XLATE16(80),
+#endif
+#if DISPLAY_HOLDS > 96
+    XLATE16(96),
+#endif
+#if DISPLAY_HOLDS > 112
+    XLATE16(112),
+#endif
+#if DISPLAY_HOLDS > 128
+    XLATE16(128),
+#endif
+#if DISPLAY_HOLDS > 144
+    XLATE16(144),
+#endif
+#if DISPLAY_HOLDS > 160
+    XLATE16(160),
+#endif
+#if DISPLAY_HOLDS > 176
+    XLATE16(176),
+#endif
+#if DISPLAY_HOLDS > 192
+    XLATE16(192),
+#endif
+#if DISPLAY_HOLDS > 208
+    XLATE16(208),
+#endif
+#if DISPLAY_HOLDS > 224
+    XLATE16(224),
+#endif
+#if DISPLAY_HOLDS > 240
+    XLATE16(240),
+#endif
+};
+static unsigned char xlate_inv[DISPLAY_HOLDS];  /**< Physical to logical hold table. */
+
+/** Default color curve, gamma 2.2 at 8 bit resolution. */
+static const unsigned char gamma_default[256] = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+      6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+     12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+     20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+     30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+     42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+     56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+     73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+     91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+    113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+    137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+    163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+    192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255
+};
+
+/** Default white balance per channel. */
+static const unsigned char gamma_wb[3] = {DISPLAY_WB_R, DISPLAY_WB_G, DISPLAY_WB_B};
+
+static unsigned char gamma_points[3][DISPLAY_GAMMA_POINTS];   /**< Color curve control points per channel. */
+static unsigned int gamma_custom;           /**< Channels with a custom curve, one bit each. */
+
 static unsigned int cf_count;           /**< Conflict counter. */
-static conflict conflicts[DISPLAY_MAX_CONFLICTS];
+static unsigned char cell_count[DISPLAY_ROWS][DISPLAY_COLS];   /**< Routes lit on each hold. */
+static display_colmask cf_cols[DISPLAY_ROWS];   /**< Holds on each row shared by more than one route. */
+static unsigned char cf_rows;               /**< Rows with at least one shared hold. */
+
+static unsigned int overlap_mode;           /**< How shared holds are shown. */
+static blend_entry blends[DISPLAY_MAX_BLENDS];  /**< Blends shown on shared holds. */
+static unsigned int blend_count;            /**< Blend entries in use. */
 
 /** Initialize display module.
  */
@@ -52,9 +271,29 @@ void display_init(void) {
     fifo_misses = 0;
 
     memset(rows, 0, sizeof(row)*DISPLAY_ROWS);
-    memset(routes, 0, sizeof(route)*DISPLAY_MAX_ROUTES);
+    memset(frame, 0, sizeof(row)*DISPLAY_ROWS);
+    memset(routes, 0, sizeof(routes));
+    memset(slot_color, 0, sizeof(slot_color));
+    memset(route_layer, 0, sizeof(route_layer));
+    memset(route_blend, 0, sizeof(route_blend));
+    memset(route_anim, 0, sizeof(route_anim));
+    memset(anims, 0, sizeof(anims));
+    anims[0].rate = 1;
+    anims[0].width = 1;
+    anims[0].level = DISPLAY_COLOR_DEPTH;
+    frame_pending = 0;
+    routes_retired = 0;
+    routes_staged = 0;
+    routes_last = ROUTE_DARK;
+    batch_open = 0;
+    batch_ticks = 0;
+    rows_dirty = 0;
+    rows_enabled = 0;
+    rows_pulses = 0;
 
     display_enabled = 0;
+    display_mode = DISPLAY_DEFAULT_MODE;
+    display_nextmode = DISPLAY_DEFAULT_MODE;
     blank = 1;
 
     process_activerow = 0;
@@ -67,8 +306,25 @@ void display_init(void) {
     hb_pos = 0;
     hb_fullcount = 0;
 
+    fade_len = 0;
+    fade_pos = 0;
+
+    raw_mode = 0;
+    raw_next = 0;
+    raw_pending = 0;
+    raw_state = RAW_IDLE;
+
     cf_count = 0;
-    memset(conflicts, 0, sizeof(conflict)*DISPLAY_MAX_CONFLICTS);
+    memset(cell_count, 0, sizeof(cell_count));
+    memset(cf_cols, 0, sizeof(cf_cols));
+    cf_rows = 0;
+
+    overlap_mode = DISPLAY_OVERLAP_FLASH;
+    blend_count = 0;
+
+    display_loadtranslation();
+    xlate_invert();
+    display_loadgamma();
 
     T2CONbits.T32 = 0;
     T2CONbits.TCKPS = 0;
@@ -76,7 +332,24 @@ void display_init(void) {
     timer_period = CLOCK_FREQUENCY / DISPLAY_SCAN_FREQ / DISPLAY_COLOR_DEPTH / DISPLAY_ROWS;
 //    PR3 = timer_period >> 16;
     PR2 = (unsigned int)(timer_period & 0xFFFF);
-    
+
+    stats_ticks = 0;                // Timer3 free runs as the statistics timebase
+    stats_frames = 0;
+    stats_isr_cycles = 0;
+    stats_isr_count = 0;
+    stats_isr_peak = 0;
+    stats_process_cycles = 0;
+    stats_process_count = 0;
+    stats_process_peak = 0;
+    stats_saturated = 0;
+
+    T3CONbits.TCKPS = 0;
+    PR3 = 0xFFFF;
+    TMR3 = 0;
+    _T3IP = DISPLAY_STATS_PRIORITY;
+    _T3IF = 0;
+    _T3IE = 1;
+    T3CONbits.TON = 1;
 }
 
 /** Enable display output.
@@ -107,12 +380,45 @@ void display_disable(void) {
     fifo_clear();
 }
 
-/** Timer3 Interrupt Service Routine.
- * Update the display frame.
+/** Timer2 Interrupt Service Routine.
+ * Update the display frame, and record the time it took.
  */
 void __attribute__((interrupt, auto_psv)) _T2Interrupt(void) {
+    unsigned int start = TMR3;
+    unsigned int cycles;
+
     _T2IF = 0;
 
+    display_tick();
+
+    cycles = TMR3 - start;
+    if (stats_isr_cycles + cycles >= stats_isr_cycles) {   // the average stays valid once full
+        stats_isr_cycles += cycles;
+        stats_isr_count++;
+    } else {
+        stats_saturated = 1;
+    }
+    if (cycles > stats_isr_peak)
+        stats_isr_peak = cycles;
+}
+
+/** Timer3 Interrupt Service Routine.
+ * Counts rollovers of the statistics timebase, and times out an open batch.
+ * The batch timeout runs here rather than per scan, so it also expires
+ * while the display is blank and nothing is scanned.
+ */
+void __attribute__((interrupt, auto_psv)) _T3Interrupt(void) {
+    _T3IF = 0;
+    stats_ticks++;
+    timebase++;
+    if (batch_open && ++batch_ticks >= BATCH_TIMEOUT_TICKS)
+        batch_open = 0;         // host went away mid batch, show what it sent
+}
+
+/** Output the next display frame.
+ * Called from the Timer2 interrupt.
+ */
+static void display_tick(void) {
     if (!display_enabled) { // if disabled, clear the display, stop timer
         ledrow_disable();   // cut row driver
         ledcol_clear();     // cut column drive
@@ -131,7 +437,9 @@ void __attribute__((interrupt, auto_psv)) _T2Interrupt(void) {
         display_data dd;
 
         fifo_get(&dd);      // remove packet from fifo
-        ledcol_display(&dd.cdata);  // send packet to column drivers
+        PR2 = dd.period;    // hold this pattern for its own period
+        ledcol_setscale(dd.scale);  // queued ahead of the packet, if it changes
+        ledcol_displaygated(&dd.cdata, dd.gate ? dd.period >> dd.gate : 0);    // send packet to column drivers
         if (timer_activerow != dd.row) {    // if new row, switch
             ledrow_switch(dd.row);
             timer_activerow = dd.row;
@@ -144,394 +452,1740 @@ void __attribute__((interrupt, auto_psv)) _T2Interrupt(void) {
 }
 
 /** Recalculate optimal display update frequency.
- * Analyzes the total number of frames per cycle, and adjusts the timer to
- * maintain the scan frequency.  It is called automatically by showroute and
- * hideroute.
+ * Uses the total number of frames per cycle in the front buffer, and
+ * adjusts the timer period to maintain the scan frequency.  Frames carry
+ * their own period, so frames already in the FIFO finish at the old rate.
+ * It is called automatically when the buffers are swapped.
  */
 static void display_frequpdate(void) {
-    unsigned int pulse_count = 0;
-    int i;
+    unsigned int pulse_count = rows_pulses;     // front buffer matches the back after a swap
 
-    for (i = 0; i < DISPLAY_ROWS; i++)          // count frames per cycle
-        pulse_count += rows[i].maxbrightness;
     if (!pulse_count)
         pulse_count = 32;
 
     timer_period = CLOCK_FREQUENCY / DISPLAY_SCAN_FREQ / pulse_count;
-//    PR3 = timer_period >> 16;
-    PR2 = (unsigned int)(timer_period & 0xFFFF);
-    TMR2 = 0;
-//    TMR3 = 0;
 }
 
+/** Swap the edited row data into the front buffer.
+ * Called at the end of a full scan, so a scan never shows a partial edit.
+ * Edits made since the last swap become visible together, without
+ * discarding the frames that are already queued.
+ */
+static void display_swap(void) {
+    int i;
+    unsigned int nblank;
+
+    if (!frame_pending || batch_open)
+        return;
+
+    if (raw_pending)
+        raw_show();
+    if (raw_mode != raw_next) {     // rows are summed from the other source
+        raw_mode = raw_next;
+        rows_dirty = (1 << DISPLAY_ROWS) - 1;
+    }
+
+    if (overlap_mode == DISPLAY_OVERLAP_COMPOSITE || blend_count)
+        composite_process();
+    display_rows_update();
+    if (display_mode != display_nextmode) {     // row lengths depend on the mode
+        display_mode = display_nextmode;
+        rows_pulses = 0;
+        for (i = 0; i < DISPLAY_ROWS; i++)
+            rows_pulses += display_row_pulses(&rows[i]);
+    }
+
+    memcpy(frame, rows, sizeof(row)*DISPLAY_ROWS);
+    routes_retired = 0;         // hidden routes are no longer referenced
+    frame_pending = 0;
+
+    nblank = !rows_enabled;
+    if (nblank)                 // nothing left to fade
+        fade_len = 0;
+    if (nblank && !blank) {     // last hold removed, cut column drive
+        blank = 1;
+        _T2IE = 0;          // TODO: is there a cleaner way to do this, is this safe?
+        ledcol_clear();
+        _T2IE = 1;
+        fifo_clear();
+    } else if (!nblank && blank) {  // restart the scan from the first row
+        blank = 0;
+        process_activerow = 0;
+        process_pwmpos = 0;
+        fifo_clear();
+    }
+
+    display_frequpdate();
+}
+
+/** Advance the heartbeat intensity by one scan.
+ * The colors of heartbeat routes are scaled here, once per scan, so the
+ * frame generator never has to.
+ */
 inline void display_hbupdate(void) {
+    int i;
+
     hb_fullcount = (hb_fullcount + 1) % (DISPLAY_HEARTBEAT_PERIOD * DISPLAY_SCAN_FREQ);
     if (hb_fullcount >= DISPLAY_HEARTBEAT_PERIOD * DISPLAY_SCAN_FREQ / 2)
         hb_pos = (DISPLAY_COLOR_DEPTH * (DISPLAY_HEARTBEAT_PERIOD * DISPLAY_SCAN_FREQ - hb_fullcount - 1) * 2) / (DISPLAY_HEARTBEAT_PERIOD * DISPLAY_SCAN_FREQ) + 1;
     else
         hb_pos = (DISPLAY_COLOR_DEPTH * hb_fullcount * 2) / (DISPLAY_HEARTBEAT_PERIOD * DISPLAY_SCAN_FREQ) + 1;
+
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (routes[i].heartbeat)
+            display_route_scale(i);
+
+    for (i = 0; i < blend_count; i++)
+        if (blends[i].heartbeat)
+            display_slot_scale(BLEND_FIRST + i, blends[i].r, blends[i].g, blends[i].b,
+                    1, DISPLAY_COLOR_DEPTH);
+}
+
+/** Update the colors shown for a route this scan.
+ * Routes are scaled by their fade level, and heartbeat routes also by the
+ * heartbeat intensity.  Other routes are shown at their full color.
+ * @param n Route slot.
+ */
+static void display_route_scale(unsigned int n) {
+    route *sroute = &routes[n];
+
+    display_slot_scale(n, sroute->r, sroute->g, sroute->b, sroute->heartbeat,
+            anims[route_anim[n]].level);
+}
+
+/** Set the colors shown for a slot this scan.
+ * @param n Route or blend slot.
+ * @param r Red channel.
+ * @param g Green channel.
+ * @param b Blue channel.
+ * @param heartbeat Scale by the heartbeat intensity.
+ * @param level Fade level, 0 to DISPLAY_COLOR_DEPTH.
+ */
+static void display_slot_scale(unsigned int n, unsigned int r, unsigned int g, unsigned int b,
+        unsigned int heartbeat, unsigned int level) {
+    unsigned char *color = slot_color[n];
+
+    if (heartbeat)
+        level = level * hb_pos / DISPLAY_COLOR_DEPTH;
+
+    if (level < DISPLAY_COLOR_DEPTH) {
+        color[0] = r * level / DISPLAY_COLOR_DEPTH;
+        color[1] = g * level / DISPLAY_COLOR_DEPTH;
+        color[2] = b * level / DISPLAY_COLOR_DEPTH;
+    } else {
+        color[0] = r;
+        color[1] = g;
+        color[2] = b;
+    }
+}
+
+/** Brightest channel of the color of a slot, before any scaling.
+ * @param n Route or blend slot.
+ */
+static unsigned int display_slot_max(unsigned int n) {
+    blend_entry *e;
+
+    if (n < BLEND_FIRST)
+        return MAX(routes[n].r, routes[n].g, routes[n].b);
+
+    e = &blends[n - BLEND_FIRST];
+    return MAX(e->r, e->g, e->b);
+}
+
+/** Advance route animations by one scan.
+ * Like the heartbeat, effects run on the device, so one command animates a
+ * route for as long as the effect lasts without any host traffic.  Hold
+ * changes go to the back buffer, and are swapped in at the end of the scan.
+ */
+static void display_animate(void) {
+    unsigned int n;
+    animation *anim;
+
+    for (n = ROUTE_FIRST; n < ROUTE_END; n++) {
+        if (!route_anim[n] || !routes[n].len || (routes_staged & ROUTE_BIT(n)))
+            continue;
+
+        anim = &anims[route_anim[n]];
+        if (++anim->tick < anim->rate)
+            continue;
+
+        anim->tick = 0;
+        animate_step(n);
+    }
+}
+
+/** Set the effect of a route.
+ * A route without an effect gives its animation entry back.  If every
+ * entry is in use, the route is shown without the effect.
+ * @param n Route slot.
+ * @param effect DISPLAY_EFFECT_* value, optionally with DISPLAY_EFFECT_LOOP.
+ * @param rate Scans per animation step.
+ * @param width Holds lit at once in a chase.
+ */
+static void animate_set(unsigned int n, unsigned char effect, unsigned char rate, unsigned char width) {
+    unsigned int k = route_anim[n];
+
+    if (!(effect & DISPLAY_EFFECT_MASK)) {
+        animate_free(n);
+        return;
+    }
+
+    if (!k)                     // entries without an effect are free
+        for (k = 1; k <= DISPLAY_MAX_EFFECTS && anims[k].effect; k++)
+            ;
+    if (k > DISPLAY_MAX_EFFECTS)
+        return;
+
+    route_anim[n] = k;
+    anims[k].effect = effect;
+    anims[k].rate = rate;
+    anims[k].width = width;
+}
+
+/** Stop the effect of a route, and free its animation entry.
+ * @param n Route slot.
+ */
+static void animate_free(unsigned int n) {
+    if (!route_anim[n])
+        return;
+
+    anims[route_anim[n]].effect = DISPLAY_EFFECT_NONE;
+    route_anim[n] = 0;
+}
+
+/** Reset the animation state of a route to the start of its effect.
+ * @param n Route slot.
+ */
+static void animate_start(unsigned int n) {
+    animation *anim = &anims[route_anim[n]];
+    unsigned int effect = anim->effect & DISPLAY_EFFECT_MASK;
+
+    if (!route_anim[n])
+        return;
+
+    anim->step = (effect == DISPLAY_EFFECT_REVEAL) ? 1 : 0;    // never start dark, or the scan stops
+    anim->tick = 0;
+    anim->level = (effect == DISPLAY_EFFECT_FADE_IN) ? 0 : DISPLAY_COLOR_DEPTH;
+    if (anim->width > routes[n].len)
+        anim->width = routes[n].len;
+    if (!anim->width)
+        anim->width = 1;
+}
+
+/** Run one step of a route animation.
+ * An effect that ends frees its animation entry.
+ * @param n Route slot.
+ */
+static void animate_step(unsigned int n) {
+    route *sroute = &routes[n];
+    animation *anim = &anims[route_anim[n]];
+    unsigned int effect = anim->effect & DISPLAY_EFFECT_MASK;
+    unsigned int loop = anim->effect & DISPLAY_EFFECT_LOOP;
+    unsigned int last;
+
+    switch (effect) {
+        case DISPLAY_EFFECT_FADE_IN:
+        case DISPLAY_EFFECT_FADE_OUT:
+            if (anim->step < DISPLAY_COLOR_DEPTH) {
+                anim->step++;
+            } else if (loop) {
+                anim->step = 0;
+            } else if (effect == DISPLAY_EFFECT_FADE_IN) {
+                animate_free(n);        // shown at full level from now on
+            } else {
+                display_removeroute(n);
+                return;
+            }
+
+            anim->level = (effect == DISPLAY_EFFECT_FADE_IN) ?
+                anim->step : DISPLAY_COLOR_DEPTH - anim->step;
+            display_route_scale(n);
+            if (blend_count)            // composited holds are blended at the swap
+                frame_pending = 1;
+            break;
+
+        case DISPLAY_EFFECT_CHASE:
+            last = loop ? sroute->len : sroute->len + anim->width - 1;
+            if (anim->step + 1 >= last && !loop) {
+                display_removeroute(n);
+                return;
+            }
+
+            if (anim->step + 1 >= anim->width)  // tail leaves the group
+                display_clearhold(n, route_hold(sroute, anim->step + 1 - anim->width));
+            else if (loop)
+                display_clearhold(n, route_hold(sroute, anim->step + 1 + sroute->len - anim->width));
+            anim->step = (anim->step + 1) % last;
+            if (anim->step < sroute->len)       // head joins the group
+                display_sethold(n, route_hold(sroute, anim->step));
+            frame_pending = 1;
+            break;
+
+        case DISPLAY_EFFECT_REVEAL:
+            if (anim->step < sroute->len) {
+                display_sethold(n, route_hold(sroute, anim->step++));
+            } else if (loop) {
+                display_clearholds(n);
+                anim->step = 0;
+                display_sethold(n, route_hold(sroute, anim->step++));
+            } else {
+                animate_free(n);
+            }
+            frame_pending = 1;
+            break;
+
+        default:
+            animate_free(n);
+            break;
+    }
+}
+
+/** Whether a hold of a route is lit at the present animation step.
+ * @param n Route slot.
+ * @param i Index of the hold in the route.
+ */
+static int animate_lit(unsigned int n, unsigned int i) {
+    animation *anim = &anims[route_anim[n]];
+
+    switch (anim->effect & DISPLAY_EFFECT_MASK) {
+        case DISPLAY_EFFECT_CHASE:          // group ends at the step
+            if (anim->effect & DISPLAY_EFFECT_LOOP)
+                return (anim->step + routes[n].len - i) % routes[n].len < anim->width;
+            return i <= anim->step && i + anim->width > anim->step;
+
+        case DISPLAY_EFFECT_REVEAL:         // holds before the step
+            return i < anim->step;
+
+        default:
+            return 1;
+    }
+}
+
+/** Number of timer periods the row occupies in one scan.
+ * In PWM mode this is the brightest color in the row, without its gate
+ * bits.  In BCM mode the row is shown for the gate bit planes, and for every
+ * bit plane up to the highest bit of that color.
+ */
+static unsigned int display_row_pulses(row *prow) {
+    unsigned int pulses = 0;
+
+    if (!prow->enabled)
+        return 0;
+
+    if (display_mode == DISPLAY_MODE_PWM)
+        return process_pwmlevel(prow->maxbrightness);
+
+    while (pulses < prow->maxbrightness >> DISPLAY_GATE_BITS)
+        pulses = (pulses << 1) | 1;
+
+    return pulses + process_gatepulses();
+}
+
+/** Select the frame modulation mode.
+ * Every mode renders the same scene, which allows them to be compared.  The
+ * new mode takes effect at the next buffer swap.
+ * @param mode DISPLAY_MODE_PWM, DISPLAY_MODE_BCM or DISPLAY_MODE_SCALED.
+ */
+void display_setmode(unsigned int mode) {
+    if (mode != DISPLAY_MODE_PWM && mode != DISPLAY_MODE_BCM && mode != DISPLAY_MODE_SCALED)
+        return;
+
+    display_nextmode = mode;
+    frame_pending = 1;
+}
+
+/** Get the present frame modulation mode.
+ * @return DISPLAY_MODE_PWM, DISPLAY_MODE_BCM or DISPLAY_MODE_SCALED.
+ */
+unsigned int display_getmode(void) {
+    return display_mode;
 }
 
 /** Process the display module.
  * This generates frames to send to the LED drivers.  It will generate frames
- * until the FIFO is full.  This module handles software PWM, heartbeat mode,
- * and row skip optimizations.  It should be called periodically while the
- * display is active.
+ * until the FIFO is full.  This module handles software PWM or bit plane
+ * modulation, heartbeat mode, and row skip optimizations.  It should be
+ * called periodically while the display is active.
  */
 void display_process(void) {
-    static display_data cbuffer;
-    static unsigned char pwmflag[DISPLAY_COLOR_DEPTH];
     row *prow;
-    route *phold;
-    int i;
     int pcount = 0;
+    unsigned int start = TMR3;
+    unsigned int cycles;
 
-    if (blank || !display_enabled)
+    if (!display_enabled)
         return;
 
-    while (!fifo_full() && pcount < 3) {      // generate frames until the buffer is full
-        if (!rows[process_activerow].enabled) {     // if row isn't active, skip
-            process_activerow++;
-            process_activerow %= DISPLAY_ROWS;
-            if (process_activerow == 0) {   // scanned through entire array
-                display_hbupdate();
-                cf_count = (cf_count + 1) % (DISPLAY_SCAN_FREQ * DISPLAY_FLASH_PERIOD);
-                if (!cf_count)
-                    conflict_process();
-            }
+    if (blank)              // nothing is scanning, pick up edits immediately
+        display_swap();
+
+    if (blank)
+        return;
+
+    while (!blank && !fifo_full() && pcount < 3) {    // generate frames until the buffer is full
+        if (!frame[process_activerow].enabled) {    // if row isn't active, skip
+            process_nextrow();
             continue;
         }
         
-        prow = &rows[process_activerow];    // pointer to active row for convenience
-
-        if (process_pwmpos == 0) {      // first entry for this row
-            memset(&cbuffer, 0, sizeof(display_data));
-            memset(pwmflag, 0, DISPLAY_COLOR_DEPTH);
-            
-            cbuffer.row = process_activerow;        
-            for (i = 0; i < DISPLAY_COLS; i++)      // loop through cols in the row
-                if ((phold = prow->holds[i])) {     // enable any hold that needs lighting
-                    if (phold->heartbeat) {         // heartbeat holds may have reduced active time
-                        unsigned int phigh;         // high pulse length
-                        phigh = phold->r * hb_pos / DISPLAY_COLOR_DEPTH;
-                        if (phigh) {
-                            ledcol_bitset_r(&cbuffer.cdata, i);
-                            pwmflag[phigh] = 1;
-                        }
-                        phigh = phold->g * hb_pos / DISPLAY_COLOR_DEPTH;
-                        if (phigh) {
-                            ledcol_bitset_g(&cbuffer.cdata, i);
-                            pwmflag[phigh] = 1;
-                        }
-                        phigh = phold->b * hb_pos / DISPLAY_COLOR_DEPTH;
-                        if (phigh) {
-                            ledcol_bitset_b(&cbuffer.cdata, i);
-                            pwmflag[phigh] = 1;
-                        }
-                    } else {    // turn on all holds that will be active on this row
-                        if (phold->r) {
-                            ledcol_bitset_r(&cbuffer.cdata, i);
-                            pwmflag[phold->r] = 1;
-                        }
-                        if (phold->g) {
-                            ledcol_bitset_g(&cbuffer.cdata, i);
-                            pwmflag[phold->g] = 1;
-                        }
-                        if (phold->b) {
-                            ledcol_bitset_b(&cbuffer.cdata, i);
-                            pwmflag[phold->b] = 1;
-                        }
-                    }
-                }
-        } else {    // not the first cycle in a row, turn off based on pwm value
-            cbuffer.repeat = 0;
-            for (i = 0; i < DISPLAY_COLS; i++)
-                if ((phold = prow->holds[i])) {
-                    if (phold->heartbeat) {
-                        if (phold->r * hb_pos / DISPLAY_COLOR_DEPTH == process_pwmpos)
-                            ledcol_bitclr_r(&cbuffer.cdata, i);
-                        if (phold->g * hb_pos / DISPLAY_COLOR_DEPTH == process_pwmpos)
-                            ledcol_bitclr_g(&cbuffer.cdata, i);
-                        if (phold->b * hb_pos / DISPLAY_COLOR_DEPTH == process_pwmpos)
-                            ledcol_bitclr_b(&cbuffer.cdata, i);
-                    } else {
-                        if (phold->r == process_pwmpos)
-                             ledcol_bitclr_r(&cbuffer.cdata, i);
-                        if (phold->g == process_pwmpos)
-                            ledcol_bitclr_g(&cbuffer.cdata, i);
-                        if (phold->b == process_pwmpos)
-                            ledcol_bitclr_b(&cbuffer.cdata, i);
-                    }
-
-                }            
+        prow = &frame[process_activerow];   // pointer to active row for convenience
+        if (process_pwmpos == 0) {          // first frame of the row
+            process_loadrow(prow);
+            process_pulses = display_row_pulses(prow);
         }
-        process_pwmpos++;   // current position has been processed
 
-        while (!pwmflag[process_pwmpos] &&          // check if pattern repeats
-                process_pwmpos < prow->maxbrightness) {
-            process_pwmpos++;
-            cbuffer.repeat++;
-        }
+        if (display_mode == DISPLAY_MODE_PWM)
+            process_pwm(prow);
+        else
+            process_bcm(prow);
 
-        fifo_put(&cbuffer);
+        fifo_put(&process_cbuffer);
         pcount++;
 
-        if (process_pwmpos >= prow->maxbrightness) {    // end of row
-            process_activerow = (process_activerow + 1) % DISPLAY_ROWS;
-            process_pwmpos = 0;
-            if (process_activerow == 0) {   // scanned through entire array
-                display_hbupdate();
-                cf_count = (cf_count + 1) % (DISPLAY_SCAN_FREQ * DISPLAY_FLASH_PERIOD);
-                if (!cf_count)
-                    conflict_process();
-            }
+        if (process_pwmpos >= process_pulses)   // end of row
+            process_nextrow();
+    }
+
+    if (pcount) {
+        cycles = TMR3 - start;
+        stats_frames += pcount;
+        if (stats_process_cycles + cycles >= stats_process_cycles) {
+            stats_process_cycles += cycles;
+            stats_process_count++;
+        } else {
+            stats_saturated = 1;
         }
+        if (cycles > stats_process_peak)
+            stats_process_peak = cycles;
     }
+}
+
+/** Read the display statistics.
+ * The rates and cycle counts restart after every read.  The counters are
+ * long, so they last between reads for as long as the host waits.  The
+ * cycle sums fill up after about four minutes at full load.  They then
+ * stop, so the averages only cover the start of the period, and the
+ * saturated flag is set.
+ * @param stats Structure to fill.
+ */
+void display_getstats(display_stats *stats) {
+    unsigned long long elapsed;
+    unsigned long scan;
+
+    __builtin_disi(0x3FFF);
+    elapsed = ((unsigned long long)stats_ticks << 16) + TMR3;
+    stats->isr_peak = stats_isr_peak;
+    stats->isr_avg = stats_isr_count ? stats_isr_cycles / stats_isr_count : 0;
+    stats->misses = fifo_misses;
+    stats_ticks = 0;
+    TMR3 = 0;
+    stats_isr_cycles = 0;
+    stats_isr_count = 0;
+    stats_isr_peak = 0;
+    stats->saturated = stats_saturated;
+    stats_saturated = 0;
+    __builtin_disi(0);
+
+    stats->frame_rate = elapsed ? (unsigned long long)stats_frames * CLOCK_FREQUENCY / elapsed : 0;
+    stats->process_peak = stats_process_peak;
+    stats->process_avg = stats_process_count ? stats_process_cycles / stats_process_count : 0;
+    stats_frames = 0;
+    stats_process_cycles = 0;
+    stats_process_count = 0;
+    stats_process_peak = 0;
 
+    scan = timer_period * (rows_pulses ? rows_pulses : 32);
+    stats->scan_rate = scan ? CLOCK_FREQUENCY / scan : 0;
 }
 
-/** Sets all of the holds in route in the row data structure.
+/** Advance the frame generator to the next row.
+ * Once the entire array has been scanned, the heartbeat and conflict state
+ * is updated, and any pending edits are swapped in.
+ */
+static void process_nextrow(void) {
+    process_activerow = (process_activerow + 1) % DISPLAY_ROWS;
+    process_pwmpos = 0;
+    if (process_activerow == 0) {   // scanned through entire array
+        display_hbupdate();
+        display_animate();
+        if (fade_len && !batch_open && ++fade_pos >= fade_len) {    // crossfade done
+            fade_len = 0;
+            rows_dirty = (1 << DISPLAY_ROWS) - 1;
+            frame_pending = 1;
+        }
+        cf_count = (cf_count + 1) % (DISPLAY_SCAN_FREQ * DISPLAY_FLASH_PERIOD);
+        if (!cf_count && cf_rows && overlap_mode == DISPLAY_OVERLAP_FLASH)
+            conflict_process();
+        display_swap();
+    }
+}
+
+/** Generate the next software PWM frame for the row.
+ * The first frame lights every active color, and each following frame turns
+ * off the colors that have reached their duty cycle.  Positions where no
+ * color changes are folded into the repeat count.  The gate bits of the
+ * colors are not shown.
+ */
+static void process_pwm(row *prow) {
+    display_data *cbuffer = &process_cbuffer;
+    display_colmask *on = process_on;
+    unsigned char *pwmflag = process_pwmflag;
+    display_colmask off[3];
+    display_colmask bit;
+    unsigned char *color;
+    int i, k;
+
+    if (process_pwmpos == 0) {      // first entry for this row
+        memset(on, 0, sizeof(process_on));
+        memset(pwmflag, 0, DISPLAY_COLOR_DEPTH);
+
+        cbuffer->row = process_activerow;
+        cbuffer->repeat = 0;
+        for (i = 0, bit = 1; i < DISPLAY_COLS; i++, bit <<= 1) {    // turn on all holds that will be active on this row
+            color = process_color[i];
+            for (k = 0; k < 3; k++) {
+                if (color[k]) {
+                    on[k] |= bit;
+                    pwmflag[process_pwmlevel(color[k])] = 1;
+                }
+            }
+        }
+    } else {    // not the first cycle in a row, turn off based on pwm value
+        cbuffer->repeat = 0;
+        off[0] = off[1] = off[2] = 0;
+        for (i = 0, bit = 1; i < DISPLAY_COLS; i++, bit <<= 1) {
+            color = process_color[i];
+            for (k = 0; k < 3; k++) {
+                if (process_pwmlevel(color[k]) == process_pwmpos)
+                    off[k] |= bit;
+            }
+        }
+        for (k = 0; k < 3; k++)
+            on[k] &= ~off[k];
+    }
+    ledcol_build(&cbuffer->cdata, on[0], on[1], on[2]);
+    cbuffer->period = (unsigned int)(timer_period & 0xFFFF);
+    cbuffer->gate = 0;
+    cbuffer->scale = 0;
+    process_pwmpos++;   // current position has been processed
+
+    while (!pwmflag[process_pwmpos] &&          // check if pattern repeats
+            process_pwmpos < process_pulses) {
+        process_pwmpos++;
+        cbuffer->repeat++;
+    }
+}
+
+/** Generate the next bit plane frame for the row.
+ * Each frame lights the colors that have the current bit set, and is shown
+ * for a binary weighted number of timer periods.  The weight is applied by
+ * stretching the timer period where it fits, so the longer planes do not
+ * cost extra timer interrupts.  The gate bits weigh less than one period.
+ * In BCM mode their planes take one period each, and C_BLANK cuts the lit
+ * time to the weight.  In scaled mode they are timed like the other planes,
+ * at the column current divided by 2^DISPLAY_GATE_BITS.  process_pwmpos
+ * counts the periods consumed in the row.
  */
-static void display_setholds(route *sroute) {
+static void process_bcm(row *prow) {
+    display_data *cbuffer = &process_cbuffer;
+    unsigned int plane = 0;
+    unsigned int pos = process_pwmpos;
+    unsigned int mask;
+    unsigned int shift;
+    unsigned int gate = 0;
+    unsigned int scale = 0;
+    unsigned int offset = 0;
+    display_colmask on[3];
+    display_colmask bit;
+    unsigned char *color;
     int i;
 
-    int mbright = MAX(sroute->r, sroute->g, sroute->b);
+    if (display_mode == DISPLAY_MODE_BCM && pos < DISPLAY_GATE_BITS) {    // plane shorter than a period
+        mask = 1 << pos;
+        gate = DISPLAY_GATE_BITS - pos;
+    } else {
+        if (pos < process_gatepulses()) {   // plane at reduced current
+            scale = DISPLAY_GATE_BITS;
+        } else {
+            pos -= process_gatepulses();
+            offset = DISPLAY_GATE_BITS;
+        }
+        while ((1 << plane) <= pos)         // recover plane from periods consumed
+            plane++;
+        mask = 1 << (plane + offset);
+    }
 
-    for (i = 0; i < sroute->len; i++) {
-        blank = 0;
-        int ppos = display_translate(sroute->holds[i]);
+    on[0] = on[1] = on[2] = 0;
+    for (i = 0, bit = 1; i < DISPLAY_COLS; i++, bit <<= 1) {
+        color = process_color[i];
+        if (color[0] & mask)
+            on[0] |= bit;
+        if (color[1] & mask)
+            on[1] |= bit;
+        if (color[2] & mask)
+            on[2] |= bit;
+    }
+    cbuffer->row = process_activerow;
+    ledcol_build(&cbuffer->cdata, on[0], on[1], on[2]);
+
+    shift = plane;          // split the plane weight between period and repeat
+    while (shift && (timer_period << shift) > 0xFFFF)
+        shift--;
+    cbuffer->period = (unsigned int)((timer_period << shift) & 0xFFFF);
+    cbuffer->repeat = (1 << (plane - shift)) - 1;
+    cbuffer->gate = gate;
+    cbuffer->scale = scale;
+
+    process_pwmpos += 1 << plane;
+}
 
-        int r = ppos >> 4;
-        int c = ppos & 0xF;
+/** Timer periods the gate bit planes of a row take in BCM modes.
+ */
+static unsigned int process_gatepulses(void) {
+    if (display_mode == DISPLAY_MODE_SCALED)
+        return (1 << DISPLAY_GATE_BITS) - 1;
+    return DISPLAY_GATE_BITS;
+}
 
-        if (rows[r].holds[c])
-            conflict_add(ppos, sroute);
-        else
-            rows[r].holds[c] = sroute;
-        
-        rows[r].enabled = 1;
-        if (rows[r].maxbrightness < mbright)
-            rows[r].maxbrightness = mbright;
+/** PWM position where a color turns off.
+ * The gate bits are dropped, but a color that is on stays on.
+ * @param color Display color.
+ * @return Timer periods the color is lit for.
+ */
+static unsigned int process_pwmlevel(unsigned int color) {
+    unsigned int level = color >> DISPLAY_GATE_BITS;
+
+    if (!level && color)
+        level = 1;
+
+    return level;
+}
+
+/** Load the colors of a row before its frames are generated.
+ * While a crossfade runs, the colors are mixed with those shown when it
+ * started, so the fade costs one pass per row and scan.
+ */
+static void process_loadrow(row *prow) {
+    unsigned char (*from)[3] = fade_from[process_activerow];
+    unsigned char *color;
+    unsigned char *shown;
+    unsigned int i, k;
+
+    if (raw_mode) {
+        memcpy(process_color, raw_front[process_activerow], sizeof(process_color));
+        return;
+    }
+
+    for (i = 0; i < DISPLAY_COLS; i++) {
+        color = process_color[i];
+        shown = slot_color[prow->holds[i]];     // dark holds read the black slot
+        color[0] = shown[0];
+        color[1] = shown[1];
+        color[2] = shown[2];
+
+        if (fade_len)           // the weighted sum overflows an int on long fades
+            for (k = 0; k < 3; k++)
+                color[k] = ((unsigned long)from[i][k] * (fade_len - fade_pos) +
+                        (unsigned long)color[k] * fade_pos) / fade_len;
     }
 }
 
+/** Sets all of the holds in route in the row data structure.
+ * Holds an animation has not lit yet are skipped.
+ * @param n Route slot.
+ */
+static void display_setholds(unsigned int n) {
+    route *sroute = &routes[n];
+    unsigned int h, i = 0;
+
+    for (h = 0; h < DISPLAY_HOLDS; h++)
+        if (DISPLAY_HOLD_TEST(sroute->holds, h) && animate_lit(n, i++))
+            display_sethold(n, h);
+}
+
+/** Set one hold of a route in the row data structure.
+ * Every call must be matched by a display_clearhold() of the same hold.
+ * @param n Route slot.
+ * @param h Logical hold.
+ */
+static void display_sethold(unsigned int n, unsigned int h) {
+    int ppos = display_translate(h);
+
+    int r = ppos / DISPLAY_COLS;
+    int c = ppos % DISPLAY_COLS;
+
+    if (cell_count[r][c]++)
+        conflict_add(r, c);
+    if (!rows[r].holds[c])
+        rows[r].holds[c] = n;
+
+    rows_dirty |= 1 << r;
+}
+
 /** Recalculate the row summary fields for use in the display process.
- * This is called internally and automatically.
+ * Keeps the enabled row mask and the scan pulse total up to date.  This is
+ * called internally and automatically.
  */
-static void display_row_recalc(row *r) {
+static void display_row_recalc(unsigned int n) {
+    row *r = &rows[n];
     int mbright = 0;
     int i;
-    route *troute;
+    unsigned char v;
+
+    rows_pulses -= display_row_pulses(r);
 
     r->enabled = 0;
     r->maxbrightness = 0;
 
-    for (i = 0; i < DISPLAY_COLS; i++)      // update enabled and maxbrightness
-        if ((troute = r->holds[i])) {
+    if (raw_mode) {                         // routes are kept, but not shown
+        r->enabled = raw_max[n] != 0;
+        r->maxbrightness = raw_max[n];
+    } else for (i = 0; i < DISPLAY_COLS; i++)   // update enabled and maxbrightness
+        if ((v = r->holds[i])) {
             r->enabled = 1;
-            mbright = MAX(troute->r, troute->g, troute->b);
+            mbright = display_slot_max(v);
             if (mbright > r->maxbrightness)
                 r->maxbrightness = mbright;
         }
+
+    if (fade_len && fade_max[n]) {  // rows of the old scene scan until the crossfade ends
+        r->enabled = 1;
+        if (fade_max[n] > r->maxbrightness)
+            r->maxbrightness = fade_max[n];
+    }
+
+    rows_pulses += display_row_pulses(r);
+    if (r->enabled)
+        rows_enabled |= 1 << n;
+    else
+        rows_enabled &= ~(1 << n);
+}
+
+/** Recalculate every row that was touched since the last update.
+ * Each row is recalculated once, no matter how many of its holds changed.
+ */
+static void display_rows_update(void) {
+    unsigned int i;
+
+    for (i = 0; rows_dirty; i++, rows_dirty >>= 1)
+        if (rows_dirty & 1)
+            display_row_recalc(i);
 }
 
 /** Remove all holds in the route from the row table.
+ * A hold shared with another route is handed over to that route.  The
+ * affected rows are marked, and recalculated at the next swap.
+ * @param n Route slot.
  */
-static void display_clearholds(route *sroute) {
-    int i;
-    route *tmp;
+static void display_clearholds(unsigned int n) {
+    route *sroute = &routes[n];
+    unsigned int h, i = 0;
+
+    for (h = 0; h < DISPLAY_HOLDS; h++)
+        if (DISPLAY_HOLD_TEST(sroute->holds, h) && animate_lit(n, i++))
+            display_clearhold(n, h);
+}
 
-    for (i = 0; i < sroute->len; i++) {
-        int ppos = display_translate(sroute->holds[i]);
-        int r = ppos >> 4;
-        int c = ppos & 0xF;
-        if (rows[r].holds[c] == sroute)
-            rows[r].holds[c] = NULL;
-        display_row_recalc(&rows[r]);
+/** Remove one lit hold of a route from the row table.
+ * @param n Route slot.
+ * @param h Logical hold.
+ */
+static void display_clearhold(unsigned int n, unsigned int h) {
+    unsigned int count;
+    unsigned int j;
+    int ppos = display_translate(h);
+    int r = ppos / DISPLAY_COLS;
+    int c = ppos % DISPLAY_COLS;
+
+    count = --cell_count[r][c];
+    if (rows[r].holds[c] == n || count <= 1) {  // shown, or no longer blended
+        rows[r].holds[c] = ROUTE_DARK;
+        for (j = ROUTE_FIRST; count && j < ROUTE_END; j++)
+            if (j != n && route_lit(j, h)) {
+                rows[r].holds[c] = j;
+                break;
+            }
     }
+    conflict_update(r, c);
+    rows_dirty |= 1 << r;
 }
 
 /** Show the route.
+ * The route is added to the back buffer, and becomes visible at the end of
+ * the present scan.  A slot that is still in the front buffer is not reused
+ * until then, unless there is no other free slot.
  */
 void display_showroute(route *theroute) {
-    int i;
-
-    for (i = 0; i < DISPLAY_MAX_ROUTES; i++)
-        if (routes[i].id == theroute->id) {
-            display_clearholds(&routes[i]);   // route already displayed, remove and then re-add
-            conflict_remove(&routes[i]);
+    unsigned int i;
+    unsigned int old = ROUTE_DARK;
+    unsigned char layer = 0;
+    unsigned char blend = DISPLAY_BLEND_REPLACE;
+    unsigned char effect = DISPLAY_EFFECT_NONE;
+    unsigned char rate = 1;
+    unsigned char width = 1;
+
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (routes[i].len && !(routes_staged & ROUTE_BIT(i)) && routes[i].id == theroute->id) {
+            layer = route_layer[i];     // an updated route keeps its layer and effect
+            blend = route_blend[i];
+            effect = anims[route_anim[i]].effect;
+            rate = anims[route_anim[i]].rate;
+            width = anims[route_anim[i]].width;
+            display_removeroute(i);     // route already displayed, remove and then re-add
+            old = i;
             break;
         }
 
-    if (i >= DISPLAY_MAX_ROUTES) 
-        for (i = 0; i < DISPLAY_MAX_ROUTES; i++)
-            if (routes[i].len == 0)
+    i = route_free();
+    if (!i)                     // no spare slot, update in place
+        i = old;
+
+    if (i) {
+        route_load(i, theroute);
+        route_layer[i] = layer;
+        route_blend[i] = blend;
+        animate_set(i, effect, rate, width);
+        animate_start(i);
+        display_route_scale(i);
+        display_setholds(i);
+        routes_last = i;
+    }
+
+    frame_pending = 1;
+}
+
+/** Add holds to a route that is displayed or staged.
+ * A route can be given more holds than fit in one command this way.  If
+ * both a displayed and a staged route have the id, the one shown or staged
+ * last is extended.
+ * @param id Route identifier.
+ * @param holds Logical holds to add.
+ * @param count Number of holds.
+ */
+void display_addholds(unsigned int id, unsigned char *holds, unsigned int count) {
+    unsigned int n = routes_last;
+    unsigned int i, shown;
+    route *sroute;
+
+    if (!routes[n].len || routes[n].id != id)
+        for (n = ROUTE_FIRST; n < ROUTE_END; n++)
+            if (routes[n].len && routes[n].id == id)
                 break;
 
-    if (i < DISPLAY_MAX_ROUTES) {
-        routes[i] = *theroute;
-        routes[i].r >>= (8 - DISPLAY_COLOR_DEPTH_BITS);
-        routes[i].g >>= (8 - DISPLAY_COLOR_DEPTH_BITS);
-        routes[i].b >>= (8 - DISPLAY_COLOR_DEPTH_BITS);
-        display_setholds(&routes[i]);
-        display_frequpdate();
-        fifo_clear();
+    if (n >= ROUTE_END)
+        return;
+
+    sroute = &routes[n];
+    shown = !(routes_staged & ROUTE_BIT(n));
+    if (shown)                  // hold order, and so the animation, may change
+        display_clearholds(n);
+
+    for (i = 0; i < count; i++)
+        if (holds[i] < DISPLAY_HOLDS && !DISPLAY_HOLD_TEST(sroute->holds, holds[i])) {
+            DISPLAY_HOLD_SET(sroute->holds, holds[i]);
+            sroute->len++;
+        }
+
+    if (shown) {
+        display_setholds(n);
+        frame_pending = 1;
     }
 }
 
-/** Hide the route. */
-void display_hideroute(unsigned int id) {
-    int i = 0;
-    int nblank = 1;
+/** Find a free route slot.
+ * Slots that are still in the front buffer are only reused when there is
+ * no other free slot, as happens when a batch reloads every route.  The
+ * colors shown are then frozen until the swap, so the live scene does not
+ * take the colors of the new route.
+ * @return Route slot, or ROUTE_DARK if there is none.
+ */
+static unsigned int route_free(void) {
+    unsigned int i;
+
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (!routes[i].len && !(routes_retired & ROUTE_BIT(i)))
+            return i;
+
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (!routes[i].len) {
+            fade_hold();
+            return i;
+        }
+
+    return ROUTE_DARK;
+}
+
+/** Copy a route from the host into a slot.
+ * The colors are mapped through the color curves, the holds are counted,
+ * and the layer and effect start at their defaults.
+ * @param n Route slot.
+ * @param theroute Route as sent by the host.
+ */
+static void route_load(unsigned int n, route *theroute) {
+    route *sroute = &routes[n];
+    unsigned int k;
+
+    *sroute = *theroute;
+    sroute->r = gamma_lookup(0, theroute->r);
+    sroute->g = gamma_lookup(1, theroute->g);
+    sroute->b = gamma_lookup(2, theroute->b);
+    route_layer[n] = 0;
+    route_blend[n] = DISPLAY_BLEND_REPLACE;
+    animate_free(n);
+
+    sroute->len = 0;
+    for (k = 0; k < DISPLAY_HOLD_WORDS; k++)
+        sroute->len += hold_count(sroute->holds[k]);
+}
+
+/** Whether a displayed route lights a hold.
+ * @param n Route slot.
+ * @param h Logical hold.
+ */
+static int route_lit(unsigned int n, unsigned int h) {
+    route *sroute = &routes[n];
+
+    if (!sroute->len || (routes_staged & ROUTE_BIT(n)) || !DISPLAY_HOLD_TEST(sroute->holds, h))
+        return 0;
+
+    return animate_lit(n, route_index(sroute, h));
+}
+
+/** Find a hold of a route by its index.
+ * @param sroute Route.
+ * @param i Index of the hold in the route, less than the route length.
+ * @return Logical hold.
+ */
+static unsigned int route_hold(route *sroute, unsigned int i) {
+    unsigned int k, h, w, count;
+
+    for (k = 0; k < DISPLAY_HOLD_WORDS; k++) {
+        w = sroute->holds[k];
+        count = hold_count(w);
+        if (i < count)
+            break;
+        i -= count;
+    }
+
+    for (h = k << 4; w; h++, w >>= 1)
+        if ((w & 1) && !i--)
+            break;
+
+    return h;
+}
+
+/** Find the index of a hold in a route.
+ * @param sroute Route.
+ * @param h Logical hold.
+ * @return Number of holds in the route before h.
+ */
+static unsigned int route_index(route *sroute, unsigned int h) {
+    unsigned int k, i = 0;
+
+    for (k = 0; k < (h >> 4); k++)
+        i += hold_count(sroute->holds[k]);
+
+    return i + hold_count(sroute->holds[h >> 4] & ((1u << (h & 0xF)) - 1));
+}
+
+/** Count the holds in one word of a hold bitmap.
+ */
+static unsigned int hold_count(unsigned int w) {
+    unsigned int count = 0;
+
+    for (; w; w &= w - 1)
+        count++;
+
+    return count;
+}
+
+/** Set the layer priority and blend mode of a displayed or staged route.
+ * Only used when shared holds are composited.
+ * @param id Route identifier.
+ * @param layer Layer priority, higher layers are blended last.
+ * @param blend DISPLAY_BLEND_REPLACE, DISPLAY_BLEND_ADD or DISPLAY_BLEND_AVERAGE.
+ */
+void display_setlayer(unsigned int id, unsigned char layer, unsigned char blend) {
+    unsigned int i;
+
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (routes[i].len && routes[i].id == id) {
+            route_layer[i] = layer;
+            route_blend[i] = blend;
+            frame_pending = 1;
+        }
+}
+
+/** Start an animation effect on a displayed or staged route.
+ * The effect restarts from the beginning, and is kept if the route is
+ * updated.  A staged route starts its effect when the scene is shown.
+ * @param id Route identifier.
+ * @param effect DISPLAY_EFFECT_* value, optionally with DISPLAY_EFFECT_LOOP.
+ * @param rate Scans per animation step.
+ * @param width Holds lit at once in a chase.
+ */
+void display_seteffect(unsigned int id, unsigned char effect, unsigned char rate, unsigned char width) {
+    unsigned int i, shown;
+
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (routes[i].len && routes[i].id == id) {
+            shown = !(routes_staged & ROUTE_BIT(i));
+            if (shown)
+                display_clearholds(i);
+            animate_set(i, effect, rate, width);
+            animate_start(i);
+            display_route_scale(i);
+            if (shown) {
+                display_setholds(i);
+                frame_pending = 1;
+            }
+        }
+}
+
+/** Add a route to the next scene.
+ * Staged routes take a slot in the route table, but are not shown until
+ * display_crossfade() is called.  A route with the id of one already staged
+ * replaces it.
+ */
+void display_stageroute(route *theroute) {
+    unsigned int i;
+
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if ((routes_staged & ROUTE_BIT(i)) && routes[i].id == theroute->id)
+            break;
+
+    if (i >= ROUTE_END)
+        i = route_free();
+    if (!i)
+        return;
+
+    route_load(i, theroute);
+    if (routes[i].len) {
+        routes_staged |= ROUTE_BIT(i);
+        routes_last = i;
+    } else {                    // no holds, the slot stays free
+        routes_staged &= ~ROUTE_BIT(i);
+    }
+}
+
+/** Crossfade from the present display to the staged scene.
+ * The colors shown now are captured, the routes are replaced by the staged
+ * scene in one rebuild, and the frame generator mixes the two over the
+ * given number of scans.  The scan keeps running, so the FIFO is not
+ * flushed.  While raw frames are shown, the scene is switched without a
+ * fade.
+ * @param scans Length of the fade, 0 or 1 to switch at the end of the scan.
+ */
+void display_crossfade(unsigned int scans) {
+    unsigned int i;
+
+    if (scans > DISPLAY_MAX_FADE)
+        scans = DISPLAY_MAX_FADE;
+    if (!scans)                 // still hide the old routes for the rest of the scan
+        scans = 1;
+
+    if (raw_next) {             // raw frames are shown, and use the fade buffer
+        fade_len = 0;
+    } else {
+        fade_capture();
+        fade_len = scans;
+        fade_pos = 0;
+    }
 
-    for (i = 0; i < DISPLAY_MAX_ROUTES; i++)
-        if (routes[i].id == id) {
-            display_clearholds(&routes[i]);
-            conflict_remove(&routes[i]);
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (routes[i].len && !(routes_staged & ROUTE_BIT(i))) {
             routes[i].id = 0;
             routes[i].len = 0;
+            animate_free(i);
         }
+    routes_retired = 0;         // the captured colors are shown until the swap
 
-    for (i = 0; i < DISPLAY_ROWS; i++)
-        if (rows[i].enabled)
-            nblank = 0;
+    routes_staged = 0;          // the staged routes are all that is left
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (routes[i].len) {
+            animate_start(i);
+            display_route_scale(i);
+        }
 
-    if (nblank) {
-        blank = 1;
-        _T2IE = 0;          // TODO: is there a cleaner way to do this, is this safe?
-        ledcol_clear();
-        _T2IE = 1;
+    display_rebuild();
+    rows_dirty = (1 << DISPLAY_ROWS) - 1;
+}
+
+/** Start a batch of display edits.
+ * Edits made until display_commitbatch() are kept in the back buffer, so
+ * they are shown together, and the scan rate and FIFO are only updated
+ * once.  A crossfade started in the batch waits for the commit.
+ */
+void display_beginbatch(void) {
+    batch_open = 1;
+    batch_ticks = 0;
+}
+
+/** Show the edits made since display_beginbatch().
+ * They are swapped in at the end of the present scan.
+ */
+void display_commitbatch(void) {
+    batch_open = 0;
+    frame_pending = 1;
+}
+
+/** Capture the colors shown now into the fade buffer.
+ * A running crossfade is captured at its present mix.  A received raw
+ * frame that has not been swapped in yet shares the buffer, so it is
+ * dropped, rather than shown later with the captured colors.
+ */
+static void fade_capture(void) {
+    unsigned int r, c, k, m;
+    unsigned char *color;
+    unsigned char *shown;
+
+    raw_pending = 0;
+    for (r = 0; r < DISPLAY_ROWS; r++) {
+        fade_max[r] = 0;
+        for (c = 0; c < DISPLAY_COLS; c++) {
+            color = fade_from[r][c];
+            shown = slot_color[blank ? ROUTE_DARK : frame[r].holds[c]];
+            if (fade_len) {     // mixed as in process_loadrow()
+                for (k = 0; k < 3; k++)
+                    color[k] = ((unsigned long)color[k] * (fade_len - fade_pos) +
+                            (unsigned long)shown[k] * fade_pos) / fade_len;
+            } else {
+                color[0] = shown[0];
+                color[1] = shown[1];
+                color[2] = shown[2];
+            }
+
+            m = MAX(color[0], color[1], color[2]);
+            if (m > fade_max[r])
+                fade_max[r] = m;
+        }
     }
+}
 
-    fifo_clear();
-    display_frequpdate();
+/** Freeze the colors shown until the next swap.
+ * Called before a slot the front buffer still shows is reloaded, so the
+ * scene on display is not repainted in the colors of the new route.  The
+ * present colors are captured and shown as the start of a crossfade, which
+ * does not advance while a batch is open.  A running crossfade continues
+ * from the captured mix.
+ */
+static void fade_hold(void) {
+    if (!blank && !raw_mode && !raw_next) {
+        fade_capture();
+        fade_len = fade_len ? fade_len - fade_pos : 1;
+        fade_pos = 0;
+        rows_dirty = (1 << DISPLAY_ROWS) - 1;
+    }
+    routes_retired = 0;         // no slot colors are shown until the swap
+}
+
+/** Switch between raw frames and routes.
+ * Routes are kept while raw frames are shown, and come back when raw mode
+ * is left.  The change takes effect at the next swap.
+ * @param on 1 to show raw frames, 0 to show routes.
+ */
+void display_setraw(unsigned int on) {
+    raw_next = on ? 1 : 0;
+    frame_pending = 1;
+}
+
+/** Start receiving a raw frame.
+ * A full frame replaces every hold.  A delta frame starts from the newest
+ * frame, and only replaces the holds in its bitmap.  A received frame that
+ * has not been shown yet is dropped for a full frame, and built on by a
+ * delta.  A running crossfade ends, as frames are received into its buffer.
+ * @param delta 1 for a delta frame, 0 for a full frame.
+ */
+void display_rawstart(unsigned int delta) {
+    if (fade_len) {
+        fade_len = 0;
+        rows_dirty = (1 << DISPLAY_ROWS) - 1;
+        frame_pending = 1;
+    }
+
+    if (delta) {
+        if (!raw_pending)       // the frame shown is the newest
+            memcpy(raw_back, raw_front, sizeof(raw_front));
+        memset(raw_map, 0, sizeof(raw_map));
+        raw_pos = 0;
+        raw_state = RAW_MAP;
+    } else {
+        memset(raw_back, 0, sizeof(raw_front));     // physical holds without a logical hold
+        raw_hold = 0;
+        raw_channel = 0;
+        raw_state = RAW_FULL;
+    }
+
+    raw_pending = 0;            // not swapped in while it is being received
+    raw_ticks = timebase;
+}
+
+/** Receive the next byte of a raw frame.
+ * A full frame is DISPLAY_RAW_FRAME_SIZE bytes, red, green and blue for
+ * each logical hold in order.  A delta frame is a DISPLAY_DELTA_MAP_SIZE
+ * byte bitmap of the changed holds, hold h in bit h % 8 of byte h / 8,
+ * followed by runs of a length and a red, green and blue color, which are
+ * applied to the changed holds in order until every one has a color.
+ * Colors go through the color curves and the translation table here, so
+ * the frame generator copies rows as they are.  A complete frame switches
+ * the display to raw mode, and is shown at the end of the scan.
+ * @param v Frame byte.
+ * @return 1 once the frame is complete.
+ */
+unsigned int display_rawput(unsigned char v) {
+    unsigned char *dst = raw_back[0][0];
+    unsigned char *cell;
+
+    raw_ticks = timebase;
+    switch (raw_state) {
+        case RAW_FULL:
+            dst[xlate[raw_hold] * 3 + raw_channel] = gamma_lookup(raw_channel, v);
+            if (++raw_channel < 3)
+                return 0;
+
+            raw_channel = 0;
+            if (++raw_hold < DISPLAY_HOLDS)
+                return 0;
+            break;
+
+        case RAW_MAP:
+            raw_map[raw_pos >> 1] |= (unsigned int)v << ((raw_pos & 1) << 3);
+            if (++raw_pos < DISPLAY_DELTA_MAP_SIZE)
+                return 0;
+
+            raw_hold = 0;
+            if (!raw_nexthold())    // nothing changed
+                break;
+            raw_state = RAW_RUN;
+            return 0;
+
+        case RAW_RUN:
+            raw_run = v ? v : 1;
+            raw_channel = 0;
+            raw_state = RAW_COLOR;
+            return 0;
+
+        case RAW_COLOR:
+            raw_color[raw_channel] = gamma_lookup(raw_channel, v);
+            if (++raw_channel < 3)
+                return 0;
+
+            do {
+                cell = &dst[xlate[raw_hold++] * 3];
+                cell[0] = raw_color[0];
+                cell[1] = raw_color[1];
+                cell[2] = raw_color[2];
+            } while (--raw_run && raw_nexthold());
+
+            if (raw_nexthold()) {   // more holds for the next run
+                raw_state = RAW_RUN;
+                return 0;
+            }
+            break;
+
+        default:                    // no frame started
+            return 1;
+    }
+
+    raw_state = RAW_IDLE;
+    raw_pending = 1;
+    raw_next = 1;
+    frame_pending = 1;
+    return 1;
+}
+
+/** Drop a raw frame the host stopped sending part way.
+ * A truncated or corrupted frame would otherwise take every later text
+ * command as frame bytes.  The frame is dropped once no byte has come for
+ * DISPLAY_RAW_TIMEOUT ms.  Should be called after the received bytes have
+ * been passed on, so a slow main loop is not taken for a gap.
+ * @return 1 if the frame was dropped, and bytes are commands again.
+ */
+unsigned int display_rawtimeout(void) {
+    if (raw_state == RAW_IDLE || timebase - raw_ticks < RAW_TIMEOUT_TICKS)
+        return 0;
+
+    raw_state = RAW_IDLE;       // not pending, the shown frame stays
+    return 1;
+}
+
+/** Advance to the next hold changed by a delta frame.
+ * @return 0 if there are no more.
+ */
+static unsigned int raw_nexthold(void) {
+    while (raw_hold < DISPLAY_HOLDS && !DISPLAY_HOLD_TEST(raw_map, raw_hold))
+        raw_hold++;
+
+    return raw_hold < DISPLAY_HOLDS;
+}
+
+/** Move the received raw frame to the one scanned out.
+ * Called at the buffer swap.
+ */
+static void raw_show(void) {
+    unsigned char *color;
+    unsigned int r, i;
+
+    memcpy(raw_front, raw_back, sizeof(raw_front));
+    for (r = 0; r < DISPLAY_ROWS; r++) {
+        raw_max[r] = 0;
+        color = raw_front[r][0];
+        for (i = 0; i < DISPLAY_COLS * 3; i++)
+            if (color[i] > raw_max[r])
+                raw_max[r] = color[i];
+    }
+
+    raw_pending = 0;
+    rows_dirty = (1 << DISPLAY_ROWS) - 1;
+}
+
+/** Select how holds shared by several routes are shown.
+ * @param mode DISPLAY_OVERLAP_FLASH or DISPLAY_OVERLAP_COMPOSITE.
+ */
+void display_setoverlap(unsigned int mode) {
+    if (mode != DISPLAY_OVERLAP_FLASH && mode != DISPLAY_OVERLAP_COMPOSITE)
+        return;
+
+    overlap_mode = mode;
+    frame_pending = 1;
+}
+
+/** Hide the route.
+ * The holds are removed from the back buffer, and go dark at the end of the
+ * present scan.
+ */
+void display_hideroute(unsigned int id) {
+    unsigned int i;
+
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (routes[i].len && !(routes_staged & ROUTE_BIT(i)) && routes[i].id == id)
+            display_removeroute(i);
+
+    frame_pending = 1;
+}
+
+/** Remove a route from the back buffer and free its slot.
+ * The slot is not reused until the front buffer no longer shows it.
+ * @param n Route slot.
+ */
+static void display_removeroute(unsigned int n) {
+    display_clearholds(n);
+    routes[n].id = 0;
+    routes[n].len = 0;
+    animate_free(n);
+    routes_retired |= ROUTE_BIT(n);
+    frame_pending = 1;
 }
 
 /** Clear all routes from the display.
+ * The display goes dark at the end of the present scan.  Staged routes are
+ * kept.
  */
 void display_clearroutes(void) {
-    int i, j;
+    unsigned int i;
 
-    blank = 1;
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (routes[i].len && !(routes_staged & ROUTE_BIT(i))) {
+            routes[i].id = 0;
+            routes[i].len = 0;
+            animate_free(i);
+            routes_retired |= ROUTE_BIT(i);
+        }
 
-    _T2IE = 0;          // TODO: is there a cleaner way to do this, is this safe?
-    ledcol_clear();
-    _T2IE = 1;
+    memset(rows, 0, sizeof(row)*DISPLAY_ROWS);
+    rows_dirty = 0;
+    rows_enabled = 0;
+    rows_pulses = 0;
 
-    for (i = 0; i < DISPLAY_MAX_ROUTES; i++) {
-        routes[i].id = 0;
-        routes[i].len = 0;
-    }
+    memset(cell_count, 0, sizeof(cell_count));
+    memset(cf_cols, 0, sizeof(cf_cols));
+    cf_rows = 0;
 
-    for (i = 0; i < DISPLAY_ROWS; i++)
-        for (j = 0; j < DISPLAY_COLS; j++)
-            rows[i].holds[j] = NULL;
+    frame_pending = 1;
+}
 
-    for (i = 0; i < DISPLAY_MAX_CONFLICTS; i++)
-        conflicts[i].route = NULL;
+/** Rebuild the row table from the active routes.
+ * Used when the hold mapping changes under routes that are displayed.
+ */
+static void display_rebuild(void) {
+    unsigned int i;
 
-    fifo_clear();
-    display_disable();
+    memset(rows, 0, sizeof(row)*DISPLAY_ROWS);
+    rows_enabled = 0;
+    rows_pulses = 0;
+
+    memset(cell_count, 0, sizeof(cell_count));
+    memset(cf_cols, 0, sizeof(cf_cols));
+    cf_rows = 0;
+
+    for (i = ROUTE_FIRST; i < ROUTE_END; i++)
+        if (routes[i].len && !(routes_staged & ROUTE_BIT(i)))
+            display_setholds(i);
+
+    frame_pending = 1;
 }
 
-/** Process conflict list, replacing active holds on display with those in the list.
+/** Cycle every shared hold to the next route on it.
+ * Only rows with shared holds are visited, and it is not called at all
+ * when no holds are shared.
  */
 static void conflict_process(void) {
-    route *tmp;
-    conflict *cf;
-    int i;
+    unsigned int r, c, h, n, k;
 
-    for (i = 0; i < DISPLAY_MAX_CONFLICTS; i++) {
-        cf = &conflicts[i];
-        if (cf->route && cf->head) {    // we have a conflict
-            tmp = rows[cf->row].holds[cf->col];
-            rows[cf->row].holds[cf->col] = cf->route;   // replace displayed hold with list head
-            while (cf->next) {
-                if (cf->next->route) {                          // bubble forward every hold in the list
-                    cf->route = cf->next->route;
-                    cf = cf->next;
-                } else {
-                    cf->next = NULL;
+    for (r = 0; r < DISPLAY_ROWS; r++) {
+        if (!(cf_rows & (1 << r)))
+            continue;
+
+        for (c = 0; c < DISPLAY_COLS; c++)
+            if (cf_cols[r] & ((display_colmask)1 << c)) {
+                h = xlate_inv[r * DISPLAY_COLS + c];
+                n = rows[r].holds[c];
+                if (n < ROUTE_FIRST || n >= ROUTE_END)
+                    n = ROUTE_END - 1;
+                for (k = 0; k < DISPLAY_MAX_ROUTES; k++) {  // rotate to the next route on the hold
+                    n = (n + 1 < ROUTE_END) ? n + 1 : ROUTE_FIRST;
+                    if (route_lit(n, h)) {
+                        rows[r].holds[c] = n;
+                        break;
+                    }
                 }
             }
-            cf->route = tmp;                            // place old displayed hold at end of the list
 
-            // TODO: recalc row?
-        }
+        rows_dirty |= 1 << r;
     }
+
+    frame_pending = 1;
 }
 
-/** Add an entry to the conflict list.
+/** Point every shared hold at the composite of its routes.
+ * Runs at the buffer swap, so blends are only computed when routes change,
+ * and the frame generator sees a single color per hold however many routes
+ * overlap.  Holds with the same set of routes share one blend entry.  When
+ * compositing is turned off, shared holds are handed back to a route.
  */
-static void conflict_add(unsigned char pos, route *theroute) {
-    conflict *gt2tail = NULL;
-    conflict *cf;
-    int i;
-    
-    for (i = 0; i < DISPLAY_MAX_CONFLICTS; i++)
-        if (conflicts[i].pos == pos && conflicts[i].route && !conflicts[i].next)
-            gt2tail = &conflicts[i];
-
-    for (i = 0; i < DISPLAY_MAX_CONFLICTS; i++)
-        if (!conflicts[i].route) {
-            cf = &conflicts[i];
-            if (gt2tail) {
-                gt2tail->next = cf;
-                cf->head = 0;
-            } else {
-                cf->head = 1;
+static void composite_process(void) {
+    unsigned int r, c, n;
+    display_routemask members;
+
+    blend_count = 0;
+
+    for (r = 0; r < DISPLAY_ROWS; r++) {
+        if (!(cf_rows & (1 << r)))
+            continue;
+
+        for (c = 0; c < DISPLAY_COLS; c++)
+            if (cf_cols[r] & ((display_colmask)1 << c)) {
+                members = composite_members(xlate_inv[r * DISPLAY_COLS + c]);
+                if (!members)
+                    continue;
+                if (overlap_mode == DISPLAY_OVERLAP_COMPOSITE) {
+                    rows[r].holds[c] = composite_get(members);
+                } else {
+                    for (n = ROUTE_FIRST; !(members & ROUTE_BIT(n)); n++)
+                        ;
+                    rows[r].holds[c] = n;
+                }
             }
-            cf->pos = pos;
-            cf->route = theroute;
-            cf->next = NULL;
-            break;
-        }
+
+        rows_dirty |= 1 << r;
+    }
 }
 
-/** Remove all conflict instances for the route passed.
+/** Find the displayed routes that light a hold.
+ * @param h Logical hold.
  */
-static void conflict_remove(route *theroute) {
-    conflict *cf;
-    int i;
+static display_routemask composite_members(unsigned int h) {
+    display_routemask members = 0;
+    unsigned int n;
 
-    for (i = 0; i < DISPLAY_MAX_CONFLICTS; i++)
-        if (conflicts[i].route == theroute) {       // we have a match
-            cf = &conflicts[i];
-            if (cf->next) {     // if it has a next, move it to here, and null the next
-                cf->route = cf->next->route;
-                cf->next->route = NULL;
-                cf->next = cf->next->next;  // could be NULL, don't care
-            } else {    // no next, remove this conflict
-                cf->route = NULL;
-            }
+    for (n = ROUTE_FIRST; n < ROUTE_END; n++)
+        if (route_lit(n, h))
+            members |= ROUTE_BIT(n);
+
+    return members;
+}
+
+/** Find or create the blend entry for a set of routes.
+ * If the blend table is full, the top layer route is shown instead.
+ * @return Route slot to show.
+ */
+static unsigned char composite_get(display_routemask members) {
+    unsigned int k;
+    unsigned int n, top = ROUTE_DARK;
+
+    for (k = 0; k < blend_count; k++)
+        if (blends[k].members == members)
+            return BLEND_FIRST + k;
+
+    if (blend_count < DISPLAY_MAX_BLENDS) {
+        composite_blend(blend_count, members);
+        return BLEND_FIRST + blend_count++;
+    }
+
+    for (n = ROUTE_FIRST; n < ROUTE_END; n++)
+        if ((members & ROUTE_BIT(n)) && (!top || route_layer[n] >= route_layer[top]))
+            top = n;
+
+    return top;
+}
+
+/** Blend a set of routes from the lowest layer up.
+ * Routes on the same layer stack in slot order.  The top layer decides
+ * whether the blend follows the heartbeat.
+ */
+static void composite_blend(unsigned int k, display_routemask members) {
+    blend_entry *dst = &blends[k];
+    unsigned int r = 0, g = 0, b = 0;
+    unsigned int sr, sg, sb;
+    unsigned int level;
+    unsigned int first = 1;
+    route *src;
+    unsigned int n, low;
+
+    dst->members = members;
+    while (members) {
+        low = ROUTE_DARK;
+        for (n = ROUTE_FIRST; n < ROUTE_END; n++)
+            if ((members & ROUTE_BIT(n)) && (!low || route_layer[n] < route_layer[low]))
+                low = n;
+        members &= ~ROUTE_BIT(low);
+        src = &routes[low];
+        level = anims[route_anim[low]].level;
+
+        sr = src->r * level / DISPLAY_COLOR_DEPTH;      // faded, but not heartbeat scaled
+        sg = src->g * level / DISPLAY_COLOR_DEPTH;
+        sb = src->b * level / DISPLAY_COLOR_DEPTH;
+
+        if (first || route_blend[low] == DISPLAY_BLEND_REPLACE) {
+            r = sr;
+            g = sg;
+            b = sb;
+        } else if (route_blend[low] == DISPLAY_BLEND_ADD) {
+            r += sr;
+            g += sg;
+            b += sb;
+            if (r > DISPLAY_COLOR_LEVELS - 1)
+                r = DISPLAY_COLOR_LEVELS - 1;
+            if (g > DISPLAY_COLOR_LEVELS - 1)
+                g = DISPLAY_COLOR_LEVELS - 1;
+            if (b > DISPLAY_COLOR_LEVELS - 1)
+                b = DISPLAY_COLOR_LEVELS - 1;
+        } else {
+            r = (r + sr) >> 1;
+            g = (g + sg) >> 1;
+            b = (b + sb) >> 1;
         }
 
-    for (i = 0; i < DISPLAY_MAX_CONFLICTS; i++) // clean up next fields that point to NULL conflict
-        if (conflicts[i].next)
-            if (conflicts[i].next->route == NULL)
-                conflicts[i].next = NULL;
+        dst->heartbeat = src->heartbeat;
+        first = 0;
+    }
+
+    dst->r = r;
+    dst->g = g;
+    dst->b = b;
+    display_slot_scale(BLEND_FIRST + k, r, g, b, dst->heartbeat, DISPLAY_COLOR_DEPTH);
+}
 
+/** Flag a hold as shared.
+ */
+static void conflict_add(unsigned int r, unsigned int c) {
+    cf_cols[r] |= (display_colmask)1 << c;
+    cf_rows |= 1 << r;
+}
+
+/** Clear the shared flag of a hold once one route or less is left on it.
+ */
+static void conflict_update(unsigned int r, unsigned int c) {
+    if (cell_count[r][c] > 1)
+        return;
+
+    cf_cols[r] &= ~((display_colmask)1 << c);
+    if (!cf_cols[r])
+        cf_rows &= ~(1 << r);
 }
 
 /** Translate logical position to physical position.
  */
 inline unsigned char display_translate(unsigned char lpos) {
-    unsigned char ppos = lpos & 0xF;
-    unsigned char p;
+    return xlate[lpos];
+}
 
-    if (lpos % 2) { // odd column
-        if ((p = (lpos & 0xF0)) < 64)  // bottom half
-            ppos += p << 1;
-        else
-            ppos += ((p - 64) << 1) + 16;
-    } else {
-        if ((p = (lpos & 0xF0)) < 64)
-            ppos += (p << 1) + 16;
-        else
-            ppos += ((p - 64) << 1);
+/** Load the translation table from NVM.
+ * The compiled default is kept unless NVM holds a valid table.  NVM must be
+ * initialized before the display.
+ */
+static void display_loadtranslation(void) {
+    const __psv__ unsigned int *nvmsig;
+    const __psv__ unsigned char *nvmdata;
+    unsigned int seen[DISPLAY_HOLD_WORDS];
+    int i;
+
+    nvmsig = nvm_read(NVM_XLATE_SIGLOC);
+    if (!nvmsig || *nvmsig != NVM_DATA_SIGNATURE)
+        return;
+
+    nvmdata = (const __psv__ unsigned char *)nvm_read(NVM_XLATE_OFFSET);
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < DISPLAY_HOLDS; i++)     // reject tables that point off the panel, or share a hold
+        if (!xlate_mark(seen, nvmdata[i]))
+            return;
+
+    for (i = 0; i < DISPLAY_HOLDS; i++)
+        xlate[i] = nvmdata[i];
+}
+
+/** Build the physical to logical hold table.
+ * The translation is one to one, so every physical hold has exactly one
+ * logical hold.
+ */
+static void xlate_invert(void) {
+    unsigned int i;
+
+    memset(xlate_inv, 0, sizeof(xlate_inv));
+    for (i = DISPLAY_HOLDS; i--; )
+        xlate_inv[xlate[i]] = i;
+}
+
+/** Mark a physical hold as used by the translation table.
+ * @param seen Bitmap of the physical holds used so far.
+ * @param p Physical hold.
+ * @return 0 if the hold is off the panel or already used.
+ */
+static unsigned int xlate_mark(unsigned int *seen, unsigned int p) {
+    if (p >= DISPLAY_HOLDS || DISPLAY_HOLD_TEST(seen, p))
+        return 0;
+
+    DISPLAY_HOLD_SET(seen, p);
+    return 1;
+}
+
+/** Replace part of the translation table.
+ * A table is loaded in chunks, which are only kept in RAM.  The chunk that
+ * reaches the last logical hold completes the table.  It is checked, the
+ * routes on the display are rebuilt with the new wiring, and the table is
+ * stored in NVM, so loading a table erases the NVM page once.  A host
+ * changing a few entries ends with a chunk that runs to the last hold.
+ *
+ * A complete table must map every logical hold to its own physical hold,
+ * or the conflict and composite code would miss routes on a shared hold.
+ * Otherwise the table in use before the first chunk is put back, which
+ * the inverse table still holds.
+ * @param start First logical hold to replace.
+ * @param count Number of entries to replace.
+ * @param ppos Physical positions for the logical holds.
+ * @return 0 if the entries were taken, 1 if the table was rejected.
+ */
+unsigned int display_settranslation(unsigned int start, unsigned int count, unsigned char *ppos) {
+    unsigned int nvmbuf[DISPLAY_HOLDS / 2 + 1];
+    unsigned int *seen = nvmbuf;
+    unsigned int i;
+
+    for (i = 0; i < count && start + i < DISPLAY_HOLDS; i++)
+        if (ppos[i] < DISPLAY_HOLDS)
+            xlate[start + i] = ppos[i];
+
+    if (start + i < DISPLAY_HOLDS)  // more chunks to come
+        return 0;
+
+    memset(seen, 0, DISPLAY_HOLD_WORDS * sizeof(unsigned int));
+    for (i = 0; i < DISPLAY_HOLDS && xlate_mark(seen, xlate[i]); i++)
+        ;
+    if (i < DISPLAY_HOLDS) {
+        for (i = 0; i < DISPLAY_HOLDS; i++)
+            xlate[xlate_inv[i]] = i;
+        return 1;
     }
 
-    return ppos;
+    memcpy(nvmbuf, xlate, DISPLAY_HOLDS);   // table and signature are written together
+    nvmbuf[DISPLAY_HOLDS / 2] = NVM_DATA_SIGNATURE;
+    nvm_program(DISPLAY_HOLDS / 2 + 1, NVM_XLATE_OFFSET, nvmbuf);
+
+    xlate_invert();
+    display_rebuild();
+    return 0;
+}
+
+/** Convert an 8 bit color level to a display color, gate bits included.
+ * A level that is on is never rounded off.
+ */
+static unsigned char gamma_depth(unsigned int level) {
+    unsigned int depth = (level * (DISPLAY_COLOR_LEVELS - 1) + 127) / 255;
+
+    if (!depth && level)
+        depth = 1;
+
+    return depth;
+}
+
+/** Map a host color level through the color curve of a channel.
+ * Colors are only mapped when a route is loaded or a raw frame arrives,
+ * so the curve is not expanded into a RAM table.  The default curve is
+ * read from flash at full resolution.  A custom curve is interpolated
+ * between its control points, and its last segment runs from 240 to 255.
+ * @param ch Channel, 0 = red, 1 = green, 2 = blue.
+ * @param v Host color level.
+ */
+static unsigned char gamma_lookup(unsigned int ch, unsigned int v) {
+    unsigned char *pts = gamma_points[ch];
+    int k, f, width;
+
+    if (!(gamma_custom & 1 << ch))
+        return gamma_depth((unsigned int)gamma_default[v] * gamma_wb[ch] / 255);
+
+    k = v >> 4;
+    f = v & 0xF;
+    width = (k == DISPLAY_GAMMA_POINTS - 2) ? 15 : 16;
+    return gamma_depth(pts[k] + ((int)pts[k + 1] - pts[k]) * f / width);
+}
+
+/** Load the color curves.
+ * Curves stored in NVM are used when present, otherwise the default gamma
+ * curve and white balance.
+ */
+static void display_loadgamma(void) {
+    const __psv__ unsigned int *nvmsig;
+    const __psv__ unsigned char *nvmdata;
+    unsigned int c, k, v;
+
+    nvmsig = nvm_read(NVM_GAMMA_SIGLOC);
+    if (nvmsig && *nvmsig == NVM_DATA_SIGNATURE) {
+        nvmdata = (const __psv__ unsigned char *)nvm_read(NVM_GAMMA_OFFSET);
+        for (c = 0; c < 3; c++) {
+            for (k = 0; k < DISPLAY_GAMMA_POINTS; k++)
+                gamma_points[c][k] = nvmdata[c * DISPLAY_GAMMA_POINTS + k];
+        }
+        gamma_custom = 0x7;
+        return;
+    }
+
+    for (c = 0; c < 3; c++)
+        for (k = 0; k < DISPLAY_GAMMA_POINTS; k++) {    // sampled, for partial custom updates
+            v = (k < DISPLAY_GAMMA_POINTS - 1) ? k << 4 : 255;
+            gamma_points[c][k] = (unsigned int)gamma_default[v] * gamma_wb[c] / 255;
+        }
+    gamma_custom = 0;
+}
+
+/** Replace the color curve of a channel, and store the curves in NVM.
+ * The curve applies to routes shown after the change.
+ * @param ch Channel, 0 = red, 1 = green, 2 = blue.
+ * @param pts DISPLAY_GAMMA_POINTS output levels, for inputs 0, 16, .. 240, 255.
+ */
+void display_setgamma(unsigned int ch, unsigned char *pts) {
+    unsigned int nvmbuf[(3 * DISPLAY_GAMMA_POINTS + 1) / 2 + 1];
+    unsigned int k;
+
+    if (ch > 2)
+        return;
+
+    for (k = 0; k < DISPLAY_GAMMA_POINTS; k++)
+        gamma_points[ch][k] = pts[k];
+    gamma_custom |= 1 << ch;
+
+    memset(nvmbuf, 0, sizeof(nvmbuf));      // points and signature are written together
+    memcpy(nvmbuf, gamma_points, sizeof(gamma_points));
+    nvmbuf[(3 * DISPLAY_GAMMA_POINTS + 1) / 2] = NVM_DATA_SIGNATURE;
+    nvm_program((3 * DISPLAY_GAMMA_POINTS + 1) / 2 + 1, NVM_GAMMA_OFFSET, nvmbuf);
 }
 
 /** Get entry from the FIFO.
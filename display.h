@@ -6,6 +6,7 @@
  */
 
 #include "ledcol.h"
+#include "ledrow.h"
 
 #ifndef DISPLAY_H
 #define	DISPLAY_H
@@ -15,6 +16,7 @@ extern "C" {
 #endif
 
 #define DISPLAY_INT_PRIORITY    4
+#define DISPLAY_STATS_PRIORITY  1           /**< Statistics timebase interrupt priority. */
 
 #define CLOCK_FREQUENCY         16000000    /**< Clock Frequency. */
 #define DISPLAY_SCAN_FREQ       60          /**< Display updates per second. */
@@ -23,71 +25,207 @@ extern "C" {
 
 #define DISPLAY_COLOR_DEPTH         32      /**< Display color depth. */
 #define DISPLAY_COLOR_DEPTH_BITS    5       /**< Bits in color. */
+#define DISPLAY_GATE_BITS           2       /**< Color bits below one timer period, shown by gating C_BLANK. */
+#define DISPLAY_COLOR_LEVELS        (DISPLAY_COLOR_DEPTH << DISPLAY_GATE_BITS)  /**< Display color values, gate bits included. */
 
-#define DISPLAY_ROUTE_LEN       20          /**< Maximum route length. */
-#define DISPLAY_MAX_ROUTES      8           /**< Maximum active routes. */
+#define DISPLAY_GAMMA_POINTS    17          /**< Control points in a color curve, every 16 input levels. */
+#define DISPLAY_WB_R            255         /**< Default red white balance, full scale 255. */
+#define DISPLAY_WB_G            255         /**< Default green white balance, full scale 255. */
+#define DISPLAY_WB_B            255         /**< Default blue white balance, full scale 255. */
+
+#define DISPLAY_MODE_PWM        0           /**< Software PWM, one frame per brightness step. */
+#define DISPLAY_MODE_BCM        1           /**< Binary code modulation, one frame per bit plane. */
+#define DISPLAY_MODE_SCALED     2           /**< BCM, with the gate bit planes weighted by reduced current. */
+#define DISPLAY_DEFAULT_MODE    DISPLAY_MODE_BCM    /**< Modulation mode selected at init. */
+
+#ifndef DISPLAY_MAX_ROUTES
+#define DISPLAY_MAX_ROUTES      64          /**< Maximum active and staged routes. */
+#endif
+#ifndef DISPLAY_MAX_EFFECTS
+#define DISPLAY_MAX_EFFECTS     8           /**< Routes animated at once, further effects are ignored. */
+#endif
+
+#if DISPLAY_COLOR_LEVELS > 256
+#error "Display colors must fit in a byte"
+#endif
 
 #define DISPLAY_FIFO_LEN        32          /**< Size of display output FIFO. */
 
+#ifndef DISPLAY_ROWS
 #define DISPLAY_ROWS            8           /**< Number of Rows in display. */
-#define DISPLAY_COLS            16          /**< Number of Cols in display. */
+#endif
+#define DISPLAY_COLS            LEDCOL_COLS /**< Number of Cols in display, set by the column drivers. */
+#define DISPLAY_HOLDS           (DISPLAY_ROWS * DISPLAY_COLS)   /**< Number of holds in display. */
 
+#if DISPLAY_ROWS > LEDROW_ROWS
+#error "DISPLAY_ROWS exceeds the rows the row driver can address"
+#endif
+#if DISPLAY_HOLDS > 256
+#error "Hold numbers must fit in a byte"
+#endif
+
+#define DISPLAY_HOLD_WORDS      ((DISPLAY_HOLDS + 15) / 16)     /**< Words in a hold bitmap. */
+#define DISPLAY_HOLD_SET(map, h)    ((map)[(h) >> 4] |= 1u << ((h) & 0xF))   /**< Add hold h to a bitmap. */
+#define DISPLAY_HOLD_TEST(map, h)   ((map)[(h) >> 4] & (1u << ((h) & 0xF)))  /**< Test hold h in a bitmap. */
+
+typedef ledcol_colmask display_colmask;    /**< Bitmask with one bit per column. */
+
+#if DISPLAY_ROWS == 8 && DISPLAY_COLS == 16
+/** Default logical to physical hold translation.
+ * Logical rows are interleaved on the panel: the bottom four logical rows
+ * drive even physical rows on odd columns and odd physical rows on even
+ * columns, and the top four the other way around. */
+#define DISPLAY_XLATE(l)    (((l) & 0xF) | \
+                            (((((l) & 0x30) << 1) | (((((l) >> 6) & 1) ^ (~(l) & 1)) << 4))))
+#else
+/** Default logical to physical hold translation.
+ * Other panels start out wired straight through, until a table is loaded
+ * with display_settranslation(). */
+#define DISPLAY_XLATE(l)    (l)
+#endif
+
+#define DISPLAY_MAX_FADE            1023    /**< Longest scene crossfade, in scans. */
+#define DISPLAY_RAW_SYNC            0xA5    /**< Starts a raw frame, never sent in a text command. */
+#define DISPLAY_RAW_FRAME_SIZE      (3 * DISPLAY_HOLDS)     /**< Bytes in a raw frame after the sync byte. */
+#define DISPLAY_DELTA_SYNC          0xA6    /**< Starts a delta frame, never sent in a text command. */
+#define DISPLAY_DELTA_MAP_SIZE      (2 * DISPLAY_HOLD_WORDS)    /**< Bytes in the changed hold bitmap of a delta frame. */
+#define DISPLAY_RAW_TIMEOUT         10      /**< Milliseconds between raw frame bytes before the frame is dropped. */
+#define DISPLAY_BATCH_TIMEOUT       2       /**< Seconds of scanning before an uncommitted batch is shown. */
 #define DISPLAY_FLASH_PERIOD        2       /**< Time between color cycles on conflicted holds. */
-#define DISPLAY_MAX_CONFLICTS       32      /**< Max number of holds that can have conflicts. */
+#define DISPLAY_MAX_BLENDS          16      /**< Max distinct sets of routes sharing holds when compositing. */
+
+#if 1 + DISPLAY_MAX_ROUTES + DISPLAY_MAX_BLENDS > 256
+#error "Route slots must fit in a byte"
+#endif
+#if DISPLAY_MAX_EFFECTS > 255
+#error "Animation entries must fit in a byte"
+#endif
+
+/** Bitmask with one bit per route slot. */
+#if DISPLAY_MAX_ROUTES <= 16
+typedef unsigned int display_routemask;
+#elif DISPLAY_MAX_ROUTES <= 32
+typedef unsigned long display_routemask;
+#elif DISPLAY_MAX_ROUTES <= 64
+typedef unsigned long long display_routemask;
+#else
+#error "DISPLAY_MAX_ROUTES must not exceed 64"
+#endif
+
+#define DISPLAY_OVERLAP_FLASH       0       /**< Shared holds cycle between their routes. */
+#define DISPLAY_OVERLAP_COMPOSITE   1       /**< Shared holds show the blended route colors. */
+
+#define DISPLAY_BLEND_REPLACE       0       /**< Route covers the layers below it. */
+#define DISPLAY_BLEND_ADD           1       /**< Route adds to the layers below it. */
+#define DISPLAY_BLEND_AVERAGE       2       /**< Route averages with the layers below it. */
+
+#define DISPLAY_EFFECT_NONE         0       /**< Route is shown steadily. */
+#define DISPLAY_EFFECT_FADE_IN      1       /**< Route fades up from dark. */
+#define DISPLAY_EFFECT_FADE_OUT     2       /**< Route fades to dark, then is hidden. */
+#define DISPLAY_EFFECT_CHASE        3       /**< A group of holds runs along the route, then it is hidden. */
+#define DISPLAY_EFFECT_REVEAL       4       /**< Holds light one at a time in route order. */
+#define DISPLAY_EFFECT_MASK         0x7F    /**< Effect bits of the effect field. */
+#define DISPLAY_EFFECT_LOOP         0x80    /**< Flag to restart the effect when it ends. */
 
-#define MAX(a,b,c) ((a > b)? a: ((b > c)? b : c))   /**< Max of three macro. */
+#define MAX(a,b,c) ((a > b)? ((a > c)? a : c) : ((b > c)? b : c))   /**< Max of three macro. */
 
-/** Structure that stores a route for display. */
+/** Structure that stores a route for display.
+ * Holds are a bitmap of logical hold numbers, so a route can use any number
+ * of holds, and animations run through them in hold number order.  The
+ * display keeps the layer and animation of a route in side tables, so only
+ * what the host sends is stored per route. */
 typedef struct {
     unsigned char id;           /**< Route identifier. Used to deactive a route. */
     unsigned char heartbeat;    /**< Flag for heartbeat mode. */
-    unsigned char len;          /**< Hold count in the route. */
     unsigned char r;            /**< Red color channel. */
     unsigned char g;            /**< Green color channel. */
     unsigned char b;            /**< Blue color channel. */
-    unsigned char holds[DISPLAY_ROUTE_LEN]; /**< Array of hold identifiers. */
+    unsigned int len;           /**< Hold count in the route, counted by the display. */
+    unsigned int holds[DISPLAY_HOLD_WORDS]; /**< Bitmap of the holds in the route. */
 } route;
 
+/** Animation state of a route with an effect.
+ * Used internally, only routes that are animated take an entry. */
+typedef struct {
+    unsigned char effect;       /**< Animation effect, with the loop flag. */
+    unsigned char rate;         /**< Scans per animation step. */
+    unsigned char width;        /**< Holds lit at once in a chase. */
+    unsigned char level;        /**< Fade level, 0 to DISPLAY_COLOR_DEPTH. */
+    unsigned char tick;         /**< Scans into the present step. */
+    unsigned int step;          /**< Animation step. */
+} animation;
+
+/** Blend of the routes that share a hold.
+ * Used internally when shared holds are composited. */
+typedef struct {
+    display_routemask members;  /**< Routes blended into the entry. */
+    unsigned char heartbeat;    /**< Follows the heartbeat, as the top layer does. */
+    unsigned char r;            /**< Blended red channel. */
+    unsigned char g;            /**< Blended green channel. */
+    unsigned char b;            /**< Blended blue channel. */
+} blend_entry;
+
 /** Structure that stores an active row for display.
  * Used internally to represent the state of the display.  It is faster and
  * more intuitive to operate on rows than on routes. */
 typedef struct {
     unsigned char enabled;          /**< Fast flag if any holds ont he row are active. */
     unsigned char maxbrightness;    /**< Max brightness in the row. */
-    route *holds[DISPLAY_COLS];     /**< Pointer back to a route structure for each hold. */
+    unsigned char holds[DISPLAY_COLS];  /**< Route slot shown on each hold, 0 if dark. */
 } row;
 
-typedef struct conflict {
-    unsigned char head;
-    union {
-        unsigned char pos;
-        struct {
-            unsigned col:4;
-            unsigned row:4;
-        };
-    };
-    route *route;
-    struct conflict *next;
-} conflict;
-
 /** Display data to send to the row/column drivers.
  * This is passed from the display module to the line drivers. */
 typedef struct {
     unsigned char row;      /**< Row that should be activated. */
     unsigned char repeat;   /**< How many periods to repeat this pattern. */
+    unsigned char gate;     /**< Lit for the period shifted right by this, 0 for the whole period. */
+    unsigned char scale;    /**< Column current shifted right by this. */
+    unsigned int period;    /**< Timer period while this pattern is displayed. */
     column_packet cdata;    /**< Raw data to send to the column drivers. */
 } display_data;
 
+/** Display timing statistics.
+ * Rates cover the time since the statistics were last read, cycle counts
+ * are instruction cycles. */
+typedef struct {
+    unsigned int misses;        /**< FIFO underruns since init. */
+    unsigned int frame_rate;    /**< Frames generated per second. */
+    unsigned int scan_rate;     /**< Scans per second at the present timer period. */
+    unsigned int isr_peak;      /**< Peak cycles in the display interrupt. */
+    unsigned int isr_avg;       /**< Average cycles in the display interrupt. */
+    unsigned int process_peak;  /**< Peak cycles in display_process(). */
+    unsigned int process_avg;   /**< Average cycles in display_process(), when it builds frames. */
+    unsigned int saturated;     /**< Averages cover only the start of the period, the sums filled up. */
+} display_stats;
+
 void display_init(void);
 void display_enable(void);
 void display_disable(void);
 void display_process(void);
+void display_setmode(unsigned int);
+unsigned int display_getmode(void);
 
 void display_showroute(route *);
 void display_hideroute(unsigned int);
 void display_clearroutes(void);
 
 inline unsigned char display_translate(unsigned char);
+unsigned int display_settranslation(unsigned int, unsigned int, unsigned char *);
+void display_setgamma(unsigned int, unsigned char *);
+void display_setlayer(unsigned int, unsigned char, unsigned char);
+void display_setoverlap(unsigned int);
+void display_seteffect(unsigned int, unsigned char, unsigned char, unsigned char);
+void display_stageroute(route *);
+void display_addholds(unsigned int, unsigned char *, unsigned int);
+void display_crossfade(unsigned int);
+void display_beginbatch(void);
+void display_setraw(unsigned int);
+void display_rawstart(unsigned int);
+unsigned int display_rawput(unsigned char);
+unsigned int display_rawtimeout(void);
+void display_commitbatch(void);
+void display_getstats(display_stats *);
 
 
 #ifdef	__cplusplus
@@ -19,9 +19,109 @@ To set up the SPI module for the Enhanced Buffer Master mode of operation:
   (and reception) will start as soon as
 */
 
+/** Bit of a column's channel within its bus stream. */
+#define LEDCOL_BITPOS(pos, ch)  (((pos) / LEDCOL_DRIVER_COLS % LEDCOL_DRIVERS_PER_BUS) * LEDCOL_DRIVER_BITS + \
+                                ((pos) % LEDCOL_DRIVER_COLS) * 3 + (ch))
+/** First packet word of a column's bus. */
+#define LEDCOL_BUSPOS(pos)      ((pos) / (LEDCOL_DRIVER_COLS * LEDCOL_DRIVERS_PER_BUS) * LEDCOL_BUS_WORDS)
+
+/** Packet word and bit mask of a column's channel. */
+#define LEDCOL_WORD(pos, ch)    ((LEDCOL_BITPOS(pos, ch) >> 4) + LEDCOL_BUSPOS(pos))
+#define LEDCOL_MASK(pos, ch)    (1u << (LEDCOL_BITPOS(pos, ch) & 0xF))
+
+/** Table entries for the columns of one driver. */
+#define LEDCOL_DRIVER_WORDS(d)  LEDCOL_COL_WORDS(d * 8), LEDCOL_COL_WORDS(d * 8 + 1), \
+                                LEDCOL_COL_WORDS(d * 8 + 2), LEDCOL_COL_WORDS(d * 8 + 3), \
+                                LEDCOL_COL_WORDS(d * 8 + 4), LEDCOL_COL_WORDS(d * 8 + 5), \
+                                LEDCOL_COL_WORDS(d * 8 + 6), LEDCOL_COL_WORDS(d * 8 + 7)
+#define LEDCOL_DRIVER_MASKS(d)  LEDCOL_COL_MASKS(d * 8), LEDCOL_COL_MASKS(d * 8 + 1), \
+                                LEDCOL_COL_MASKS(d * 8 + 2), LEDCOL_COL_MASKS(d * 8 + 3), \
+                                LEDCOL_COL_MASKS(d * 8 + 4), LEDCOL_COL_MASKS(d * 8 + 5), \
+                                LEDCOL_COL_MASKS(d * 8 + 6), LEDCOL_COL_MASKS(d * 8 + 7)
+#define LEDCOL_COL_WORDS(pos)   {LEDCOL_WORD(pos, 0), LEDCOL_WORD(pos, 1), LEDCOL_WORD(pos, 2)}
+#define LEDCOL_COL_MASKS(pos)   {LEDCOL_MASK(pos, 0), LEDCOL_MASK(pos, 1), LEDCOL_MASK(pos, 2)}
+
+/** Packet word of each column and channel. */
+static const unsigned char col_word[LEDCOL_COLS][3] = {
+    LEDCOL_DRIVER_WORDS(0),
+#if LEDCOL_DRIVERS > 1
+    LEDCOL_DRIVER_WORDS(1),
+#endif
+#if LEDCOL_DRIVERS > 2
+    LEDCOL_DRIVER_WORDS(2),
+#endif
+#if LEDCOL_DRIVERS > 3
+    LEDCOL_DRIVER_WORDS(3),
+#endif
+#if LEDCOL_DRIVERS > 4
+    LEDCOL_DRIVER_WORDS(4),
+#endif
+#if LEDCOL_DRIVERS > 5
+    LEDCOL_DRIVER_WORDS(5),
+#endif
+#if LEDCOL_DRIVERS > 6
+    LEDCOL_DRIVER_WORDS(6),
+#endif
+#if LEDCOL_DRIVERS > 7
+    LEDCOL_DRIVER_WORDS(7),
+#endif
+};
+
+/** Bit mask of each column and channel in its packet word. */
+static const unsigned int col_mask[LEDCOL_COLS][3] = {
+    LEDCOL_DRIVER_MASKS(0),
+#if LEDCOL_DRIVERS > 1
+    LEDCOL_DRIVER_MASKS(1),
+#endif
+#if LEDCOL_DRIVERS > 2
+    LEDCOL_DRIVER_MASKS(2),
+#endif
+#if LEDCOL_DRIVERS > 3
+    LEDCOL_DRIVER_MASKS(3),
+#endif
+#if LEDCOL_DRIVERS > 4
+    LEDCOL_DRIVER_MASKS(4),
+#endif
+#if LEDCOL_DRIVERS > 5
+    LEDCOL_DRIVER_MASKS(5),
+#endif
+#if LEDCOL_DRIVERS > 6
+    LEDCOL_DRIVER_MASKS(6),
+#endif
+#if LEDCOL_DRIVERS > 7
+    LEDCOL_DRIVER_MASKS(7),
+#endif
+};
+
+/** Four columns of one channel, spread to every third bit of a driver. */
+static const unsigned int col_spread[16] = {
+    0x000, 0x001, 0x008, 0x009, 0x040, 0x041, 0x048, 0x049,
+    0x200, 0x201, 0x208, 0x209, 0x240, 0x241, 0x248, 0x249
+};
+
+static unsigned long ledcol_spread(unsigned int);
+static void ledcol_send(unsigned int, unsigned int *);
+static void ledcol_queue(column_packet *, unsigned int, unsigned int);
+static void ledcol_next(unsigned int);
+static void ledcol_stop(void);
+
+static void ledcol_gate(unsigned int);
+static void ledcol_control(void);
+
+static unsigned int txq[LEDCOL_BUSES][LEDCOL_QUEUE_LEN][LEDCOL_BUS_WORDS];  /**< Packets waiting for each bus. */
+static unsigned int txq_gate[LEDCOL_QUEUE_LEN]; /**< Lit time of the packets waiting on SPI1. */
+static unsigned int tx_gate;                    /**< Lit time of the packet shifting on SPI1. */
+static unsigned char txq_head[LEDCOL_BUSES];    /**< Oldest waiting packet of each bus. */
+static unsigned char txq_count[LEDCOL_BUSES];   /**< Packets waiting on each bus. */
+static unsigned char txq_control[LEDCOL_BUSES][LEDCOL_QUEUE_LEN];  /**< Waiting packet is a control packet. */
+static unsigned char tx_busy[LEDCOL_BUSES];     /**< Bus is shifting out a packet. */
+static unsigned char tx_enabled;                /**< Buses are on, packets are sent. */
+static unsigned char tx_stopping;               /**< Disable the buses once they are idle. */
+
 static unsigned int gbright_r = MAX_CURRENT_R;
 static unsigned int gbright_g = MAX_CURRENT_G;
 static unsigned int gbright_b = MAX_CURRENT_B;
+static unsigned int gscale;         /**< Channel currents are shifted right by this. */
 
 /**
  * Initialize the LED Column driver.
@@ -62,30 +162,52 @@ void ledcol_init(void) {
     SPI2STATbits.SPIROV = 0;    // clear overflow flag
     SPI2STATbits.SISEL = 5;     // interupt when transmission completes
 
+    // OC1 Initialization, gates C_BLANK
+    OC1CON1 = 0;
+    OC1CON2 = 0;                // free running, not synchronized
+    OC1CON1bits.OCTSEL = 7;     // count instruction cycles, same as Timer2
+    tx_gate = 0;
+
     ledcol_enable();
     ledcol_setbrightness(MAX_CURRENT_R, MAX_CURRENT_G, MAX_CURRENT_B);
     ledcol_disable();
 }
 
 /** Enable the SPI channels on the LED Column Driver.
+ * Cancels a disable that is still waiting for the buses to go idle.
  */
 void ledcol_enable(void) {
-    SPI1STATbits.SPIEN = 1;
-    SPI2STATbits.SPIEN = 1;
-    _SPI1IF = 0;
-    _SPI1IE = 1;
-    _SPI2IF = 0;
-    _SPI2IE = 1;
+    __builtin_disi(0x3FFF);
+    tx_stopping = 0;
+    if (!tx_busy[0] && !tx_busy[1]) {   // otherwise still running
+        tx_enabled = 1;
+        SPI1STATbits.SPIEN = 1;
+        SPI2STATbits.SPIEN = 1;
+        _SPI1IF = 0;
+        _SPI1IE = 1;
+        _SPI2IF = 0;
+        _SPI2IE = 1;
+    }
+    __builtin_disi(0);
 }
 
 /** Disable the SPI channels for the LED Column Driver.
+ * Packets already queued are sent first, so the buses are turned off by
+ * the SPI interrupt once they are idle, instead of waiting here.
  */
 void ledcol_disable(void) {
-    while (!SPI1STATbits.SRMPT)
-        ;
-    while (!SPI2STATbits.SRMPT)
-        ;
-    
+    __builtin_disi(0x3FFF);
+    tx_stopping = 1;
+    if (!tx_busy[0] && !tx_busy[1])
+        ledcol_stop();
+    __builtin_disi(0);
+}
+
+/** Turn off both SPI channels.
+ */
+static void ledcol_stop(void) {
+    tx_enabled = 0;
+    tx_stopping = 0;
     SPI1STATbits.SPIEN = 0;
     SPI2STATbits.SPIEN = 0;
 }
@@ -101,8 +223,7 @@ void ledcol_disable(void) {
  * @param bb Blue Channel Brightness
  */
 void ledcol_setbrightness(unsigned char rb, unsigned char gb, unsigned char bb) {
-    column_packet pack;
-
+    __builtin_disi(0x3FFF);     // the display interrupt changes the scale, and sends its own packet
     gbright_r = rb;
     gbright_g = gb;
     gbright_b = bb;
@@ -111,12 +232,62 @@ void ledcol_setbrightness(unsigned char rb, unsigned char gb, unsigned char bb)
 //    assert(gbright_g > MAX_CURRENT_G);
 //    assert(gbright_b > MAX_CURRENT_B);
 
+    ledcol_control();
+    __builtin_disi(0);
+}
+
+/** Scale the LED current down by a power of two.
+ * This weights a bit plane by current instead of time.  The control packet
+ * is queued like column data, so it applies from the next packet sent, and
+ * nothing is sent if the scale does not change.
+ * @param shift Currents are divided by 2^shift, 0 for the set brightness.
+ */
+void ledcol_setscale(unsigned int shift) {
+    if (shift == gscale)
+        return;
+
+    __builtin_disi(0x3FFF);
+    gscale = shift;
+    ledcol_control();
+    __builtin_disi(0);
+}
+
+/** Send the control packet for the present brightness and scale.
+ * Called with interrupts disabled, so a scale change cannot come between
+ * reading gscale and queuing the packet.
+ */
+static void ledcol_control(void) {
+    column_packet pack;
+    unsigned int rb = gbright_r >> gscale;
+    unsigned int gb = gbright_g >> gscale;
+    unsigned int bb = gbright_b >> gscale;
+#if LEDCOL_DRIVERS_PER_BUS > 1
+    unsigned long ctrl;
+    unsigned int drv, pos;
+    unsigned int *w;
+#endif
+
     // format control packet for transmission
-    pack.data16[1] = pack.data16[3] = LEDCOL_CMD_CONTROL | gbright_b >> 2;
-    pack.data16[0] = pack.data16[2] = gbright_b << 14 | gbright_g << 7 | gbright_r;
+#if LEDCOL_DRIVERS_PER_BUS > 1
+    memset(&pack, 0, sizeof(pack));
+    ctrl = ((unsigned long)(LEDCOL_CMD_CONTROL | bb >> 2) << 16 |
+            bb << 14 | gb << 7 | rb) & ((1UL << LEDCOL_DRIVER_BITS) - 1);
+    for (drv = 0; drv < LEDCOL_DRIVERS; drv++) {    // same settings for every driver
+        pos = drv % LEDCOL_DRIVERS_PER_BUS * LEDCOL_DRIVER_BITS;
+        w = &pack.data16[drv / LEDCOL_DRIVERS_PER_BUS * LEDCOL_BUS_WORDS + (pos >> 4)];
+        pos &= 0xF;
+        w[0] |= (unsigned int)(ctrl << pos);
+        w[1] |= (unsigned int)(ctrl >> (16 - pos));
+        if (pos > 7)            // 25 register bits reach a third word
+            w[2] |= (unsigned int)(ctrl >> (32 - pos));
+    }
+#else
+    pack.data16[1] = pack.data16[3] = LEDCOL_CMD_CONTROL | bb >> 2;
+    pack.data16[0] = pack.data16[2] = bb << 14 | gb << 7 | rb;
+#endif
 
     // transmit to high and low column drivers
-    ledcol_display(&pack);
+    ledcol_queue(&pack, 0, 1);
 }
 
 /** Get the present LED Brightness.
@@ -133,20 +304,135 @@ void ledcol_getbrightness(unsigned char *pr, unsigned char *pg, unsigned char *p
 }
 
 /** Set display with the column packet data.
- *
- * Transmits and latches the column packet data in the LED driver.
+ * The columns stay lit until the next packet is latched.
  * @param cdata Column data packet.
  */
 void ledcol_display(column_packet *cdata) {
-    while (!SPI1STATbits.SRMPT)
-        ;
-    while (!SPI2STATbits.SRMPT)
-        ;
-    
-    SPI1BUF = cdata->data16[1];
-    SPI2BUF = cdata->data16[3];
-    SPI1BUF = cdata->data16[0];
-    SPI2BUF = cdata->data16[2];
+    ledcol_displaygated(cdata, 0);
+}
+
+/** Set display with the column packet data, lit for part of its time.
+ *
+ * Transmits and latches the column packet data in the LED driver.  A bus
+ * that is idle starts shifting right away.  Otherwise the packet is queued,
+ * and the SPI interrupt sends it once the previous one has been latched, so
+ * the caller never waits for the bus.  Packets are dropped while the buses
+ * are disabled.
+ * @param cdata Column data packet.
+ * @param gate Instruction cycles the columns stay lit after the latch, 0
+ * to stay lit until the next packet.
+ */
+void ledcol_displaygated(column_packet *cdata, unsigned int gate) {
+    __builtin_disi(0x3FFF);
+    ledcol_queue(cdata, gate, 0);
+    __builtin_disi(0);
+}
+
+/** Send a packet, or queue it behind the one shifting out.
+ * Called with interrupts disabled.  If the queue is full, the newest
+ * queued data packet is replaced.  A queued control packet is never lost,
+ * because the drivers would then run at a current gscale does not expect:
+ * data is dropped instead, and a newer control packet takes its place,
+ * since it sets the whole register.
+ * @param cdata Column or control packet.
+ * @param gate Instruction cycles the columns stay lit after the latch.
+ * @param control 1 for a control packet, 0 for column data.
+ */
+static void ledcol_queue(column_packet *cdata, unsigned int gate, unsigned int control) {
+    unsigned int bus, n;
+
+    for (bus = 0; bus < LEDCOL_BUSES && tx_enabled; bus++) {
+        if (!tx_busy[bus]) {
+            if (!bus)
+                tx_gate = gate;
+            ledcol_send(bus, &cdata->data16[bus * LEDCOL_BUS_WORDS]);
+            continue;
+        }
+
+        if (txq_count[bus] < LEDCOL_QUEUE_LEN) {
+            txq_count[bus]++;
+            n = (txq_head[bus] + txq_count[bus] - 1) % LEDCOL_QUEUE_LEN;
+        } else {                // full, replace the newest packet
+            n = (txq_head[bus] + LEDCOL_QUEUE_LEN - 1) % LEDCOL_QUEUE_LEN;
+            if (txq_control[bus][n] && !control)
+                continue;
+        }
+        memcpy(txq[bus][n], &cdata->data16[bus * LEDCOL_BUS_WORDS], sizeof(txq[bus][n]));
+        txq_control[bus][n] = control;
+        if (!bus)
+            txq_gate[n] = gate;
+    }
+}
+
+/** Start shifting a packet out on a bus.
+ * The whole packet fits the transmit buffer.  Lowest word goes out last.
+ * @param bus 0 for SPI1, 1 for SPI2.
+ * @param words LEDCOL_BUS_WORDS words for the bus.
+ */
+static void ledcol_send(unsigned int bus, unsigned int *words) {
+    volatile unsigned int *buf = bus ? &SPI2BUF : &SPI1BUF;
+    int i;
+
+    tx_busy[bus] = 1;
+    for (i = LEDCOL_BUS_WORDS - 1; i >= 0; i--)
+        *buf = words[i];
+}
+
+/** Send the next queued packet once a bus has latched the last one.
+ * Called from the SPI interrupts.  Applies a deferred disable once both
+ * buses are idle.
+ * @param bus 0 for SPI1, 1 for SPI2.
+ */
+static void ledcol_next(unsigned int bus) {
+    if (txq_count[bus]) {
+        if (!bus)
+            tx_gate = txq_gate[txq_head[bus]];
+        ledcol_send(bus, txq[bus][txq_head[bus]]);
+        txq_head[bus] = (txq_head[bus] + 1) % LEDCOL_QUEUE_LEN;
+        txq_count[bus]--;
+        return;
+    }
+
+    tx_busy[bus] = 0;
+    if (tx_stopping && !tx_busy[0] && !tx_busy[1])
+        ledcol_stop();
+}
+
+/** Build a column packet from the columns lit in each channel.
+ * Each driver takes eight columns of each channel, interleaved by the
+ * spread table, so a packet costs a few table reads per driver instead of
+ * a bit operation per column and channel.
+ * @param cdata Column data packet to fill.
+ * @param r Columns with red on, column 0 in bit 0.
+ * @param g Columns with green on.
+ * @param b Columns with blue on.
+ */
+void ledcol_build(column_packet *cdata, ledcol_colmask r, ledcol_colmask g, ledcol_colmask b) {
+    unsigned long bits;
+    unsigned int drv, pos;
+    unsigned int *w;
+
+    memset(cdata, 0, sizeof(column_packet));
+    for (drv = 0; drv < LEDCOL_DRIVERS; drv++) {
+        bits = ledcol_spread(r) | ledcol_spread(g) << 1 | ledcol_spread(b) << 2;
+        r >>= LEDCOL_DRIVER_COLS;
+        g >>= LEDCOL_DRIVER_COLS;
+        b >>= LEDCOL_DRIVER_COLS;
+
+        pos = drv % LEDCOL_DRIVERS_PER_BUS * LEDCOL_DRIVER_BITS;   // first bit within the bus
+        w = &cdata->data16[drv / LEDCOL_DRIVERS_PER_BUS * LEDCOL_BUS_WORDS + (pos >> 4)];
+        pos &= 0xF;
+        w[0] |= (unsigned int)(bits << pos);
+        w[1] |= (unsigned int)(bits >> (16 - pos));
+        if (pos > 8)            // 24 data bits reach a third word
+            w[2] |= (unsigned int)(bits >> (32 - pos));
+    }
+}
+
+/** Spread the low eight columns of one channel to every third bit.
+ */
+static unsigned long ledcol_spread(unsigned int cols) {
+    return col_spread[cols & 0xF] | (unsigned long)col_spread[(cols >> 4) & 0xF] << 12;
 }
 
 /** Clear all channels in the LED driver.*/
@@ -158,39 +444,61 @@ void ledcol_clear(void) {
 }
 
 /** Fast disable of column drive.
+ * Lasts until the next packet is latched.
  */
 void ledcol_blank(void) {
-    LEDCOL_PORT_C_BLANK = 1;
+    ledcol_gate(1);
 }
 
 /** Fast reenable of column drive.
  */
 void ledcol_unblank(void) {
-    LEDCOL_PORT_C_BLANK = 0;
+    ledcol_gate(0);
+}
+
+/** Light the columns, and blank them again after a number of cycles.
+ * C_BLANK is driven by OC1 in single shot mode, which releases the pin when
+ * it is armed and sets it at the compare, so the lit time is exact however
+ * late the next interrupt is.
+ * @param width Instruction cycles to stay lit, 0 to stay lit.
+ */
+static void ledcol_gate(unsigned int width) {
+    OC1CON1bits.OCM = 0;        // off, C_BLANK low
+    if (!width)
+        return;
+
+    OC1TMR = 0;
+    OC1R = width;
+    OC1CON1bits.OCM = 1;        // single shot, C_BLANK high at the compare
 }
 
 /** SPI1 Interrupt Service Handler
  *
- * Once the display string has been transmitted, latch the data and reset the
- * bus to the default state.
+ * Once the display string has been transmitted, latch the data, start its
+ * C_BLANK gate, and start the next queued packet.
  */
 void __attribute__((interrupt, auto_psv)) _SPI1Interrupt(void) {
     _SPI1IF = 0;    // clear interrupt flag
 
     LEDCOL_PORT_C0_LAT = 1;       // latch transmitted data
     LEDCOL_PORT_C0_LAT = 0;
+    ledcol_gate(tx_gate);         // lit time starts at the latch
+
+    ledcol_next(0);
 }
 
 /** SPI2 Interrupt Service Handler
  *
- * Once the display string has been transmitted, latch the data and reset the
- * bus to the default state.
+ * Once the display string has been transmitted, latch the data and start
+ * the next queued packet.
  */
 void __attribute__((interrupt, auto_psv)) _SPI2Interrupt(void) {
     _SPI2IF = 0;    // clear interrupt flag
 
     LEDCOL_PORT_C1_LAT = 1;       // latch transmitted data
     LEDCOL_PORT_C1_LAT = 0;
+
+    ledcol_next(1);
 }
 
 /** Fast bit enable function for R bits in column_packet's.
@@ -198,9 +506,7 @@ void __attribute__((interrupt, auto_psv)) _SPI2Interrupt(void) {
  * @param pos bit number to modify.
  */
 inline void ledcol_bitset_r(column_packet *cdata, unsigned int pos) {
-    unsigned int bitp32 = (pos % 8) * 3;    // position within 32 bits
-    unsigned int wordn = (bitp32 >> 4) + ((pos >> 3) << 1);
-    cdata->data16[wordn] |= (1 << (bitp32 % 16));
+    cdata->data16[col_word[pos][0]] |= col_mask[pos][0];
 }
 
 /** Fast bit enable function for G bits in column_packet's.
@@ -208,9 +514,7 @@ inline void ledcol_bitset_r(column_packet *cdata, unsigned int pos) {
  * @param pos bit number to modify.
  */
 inline void ledcol_bitset_g(column_packet *cdata, unsigned int pos) {
-    unsigned int bitp32 = (pos % 8) * 3 + 1;    // position within 32 bits
-    unsigned int wordn = (bitp32 >> 4) + ((pos >> 3) << 1);
-    cdata->data16[wordn] |= (1 << (bitp32 % 16));
+    cdata->data16[col_word[pos][1]] |= col_mask[pos][1];
 }
 
 /** Fast bit enable function for B bits in column_packet's.
@@ -218,9 +522,7 @@ inline void ledcol_bitset_g(column_packet *cdata, unsigned int pos) {
  * @param pos bit number to modify.
  */
 inline void ledcol_bitset_b(column_packet *cdata, unsigned int pos) {
-    unsigned int bitp32 = (pos % 8) * 3 + 2;    // position within 32 bits
-    unsigned int wordn = (bitp32 >> 4) + ((pos >> 3) << 1);
-    cdata->data16[wordn] |= (1 << (bitp32 % 16));
+    cdata->data16[col_word[pos][2]] |= col_mask[pos][2];
 }
 
 /** Fast bit clear function for R bits in column_packet's.
@@ -228,9 +530,7 @@ inline void ledcol_bitset_b(column_packet *cdata, unsigned int pos) {
  * @param pos bit number to modify.
  */
 inline void ledcol_bitclr_r(column_packet *cdata, unsigned int pos) {
-    unsigned int bitp32 = (pos % 8) * 3;    // position within 32 bits
-    unsigned int wordn = (bitp32 >> 4) + ((pos >> 3) << 1);
-    cdata->data16[wordn] &= ~(1 << (bitp32 % 16));
+    cdata->data16[col_word[pos][0]] &= ~col_mask[pos][0];
 }
 
 /** Fast bit clear function for G bits in column_packet's.
@@ -238,9 +538,7 @@ inline void ledcol_bitclr_r(column_packet *cdata, unsigned int pos) {
  * @param pos bit number to modify.
  */
 inline void ledcol_bitclr_g(column_packet *cdata, unsigned int pos) {
-    unsigned int bitp32 = (pos % 8) * 3 + 1;    // position within 32 bits
-    unsigned int wordn = (bitp32 >> 4) + ((pos >> 3) << 1);
-    cdata->data16[wordn] &= ~(1 << (bitp32 % 16));
+    cdata->data16[col_word[pos][1]] &= ~col_mask[pos][1];
 }
 
 /** Fast bit clear function for B bits in column_packet's.
@@ -248,7 +546,5 @@ inline void ledcol_bitclr_g(column_packet *cdata, unsigned int pos) {
  * @param pos bit number to modify.
  */
 inline void ledcol_bitclr_b(column_packet *cdata, unsigned int pos) {
-    unsigned int bitp32 = (pos % 8) * 3 + 2;    // position within 32 bits
-    unsigned int wordn = (bitp32 >> 4) + ((pos >> 3) << 1);
-    cdata->data16[wordn] &= ~(1 << (bitp32 % 16));
+    cdata->data16[col_word[pos][2]] &= ~col_mask[pos][2];
 }
\ No newline at end of file
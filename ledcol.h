@@ -15,11 +15,38 @@ extern "C" {
 #endif
 
 #define LEDCOL_INT_PRIORITY 5           /** LEDCOL interrupt priority. */
+#define LEDCOL_QUEUE_LEN    4           /** Packets queued per bus while it is shifting. */
+
+#ifndef LEDCOL_DRIVERS_PER_BUS
+#define LEDCOL_DRIVERS_PER_BUS  1       /** TLC5952 drivers daisy chained on each SPI bus. */
+#endif
+#define LEDCOL_BUSES        2           /** SPI buses driving columns, SPI1 then SPI2. */
+#define LEDCOL_DRIVER_COLS  8           /** RGB columns on one TLC5952. */
+#define LEDCOL_DRIVER_BITS  25          /** Shift register length of one TLC5952. */
+#define LEDCOL_DRIVERS      (LEDCOL_BUSES * LEDCOL_DRIVERS_PER_BUS)   /** Total TLC5952 drivers. */
+#define LEDCOL_COLS         (LEDCOL_DRIVERS * LEDCOL_DRIVER_COLS)     /** Total RGB columns. */
+#define LEDCOL_BUS_WORDS    ((LEDCOL_DRIVERS_PER_BUS * LEDCOL_DRIVER_BITS + 15) / 16)   /** 16 bit words shifted out per bus. */
+#define LEDCOL_PACKET_WORDS (LEDCOL_BUSES * LEDCOL_BUS_WORDS)  /** 16 bit words in a column packet. */
+
+#if LEDCOL_BUS_WORDS > 8
+#error "A bus packet must fit the 8 word SPI transmit buffer"
+#endif
+
+/** Bitmask with one bit per column. */
+#if LEDCOL_COLS <= 16
+typedef unsigned int ledcol_colmask;
+#elif LEDCOL_COLS <= 32
+typedef unsigned long ledcol_colmask;
+#elif LEDCOL_COLS <= 64
+typedef unsigned long long ledcol_colmask;
+#else
+#error "LEDCOL_COLS must not exceed 64"
+#endif
 
 #define LEDCOL_CMD_CONTROL  0xFF00      /** TLC5952 control command. */
 #define LEDCOL_CMD_DATA     0x0000      /** TLC5952 data command. */
 
-#define LEDCOL_PORT_C_BLANK _RB5        /** uC port for C_BLANK. */
+#define LEDCOL_PORT_C_BLANK _RB5        /** uC port for C_BLANK, driven by OC1 through pin select. */
 #define LEDCOL_PORT_C0_LAT  _RB4        /** uC port for C0_LAT. */
 #define LEDCOL_PORT_C1_LAT  _RC6        /** uC port for C1_LAT. */
 
@@ -27,19 +54,14 @@ extern "C" {
 #define MAX_CURRENT_G ((int)(20.0/35*127))    /** Max current for G channel, set to 20mA. */
 #define MAX_CURRENT_B ((int)(20.0/26.3*127))  /** Max current for B channel, set to 20mA. */
 
-/** Data packet for TLC5952. */
+/** Data packet for TLC5952.
+ * Holds LEDCOL_BUS_WORDS words for SPI1 followed by the same for SPI2.  Each
+ * bus is one bit stream, lowest word shifted out last, with the 25 bit
+ * registers of the chained drivers packed back to back from bit 0.  The
+ * driver nearest the controller takes the lowest columns and bits. */
 typedef union {
-    struct {
-        unsigned :16;
-        unsigned :8;
-        unsigned char cmdsig;
-        unsigned :16;
-        unsigned :8;
-        unsigned char cmdsig2;
-    };
-    unsigned char data8[8];
-    unsigned int data16[4];
-    unsigned long data32[2];
+    unsigned char data8[LEDCOL_PACKET_WORDS * 2];
+    unsigned int data16[LEDCOL_PACKET_WORDS];
 } column_packet;
 
 void ledcol_init(void);
@@ -47,8 +69,11 @@ void ledcol_enable(void);
 void ledcol_disable(void);
 void ledcol_setbrightness(unsigned char, unsigned char, unsigned char);
 void ledcol_getbrightness(unsigned char *, unsigned char *, unsigned char *);
+void ledcol_setscale(unsigned int);
 
 void ledcol_display(column_packet *);
+void ledcol_displaygated(column_packet *, unsigned int);
+void ledcol_build(column_packet *, ledcol_colmask, ledcol_colmask, ledcol_colmask);
 void ledcol_clear(void);
 
 void ledcol_blank(void);
@@ -20,6 +20,7 @@ extern "C" {
 #define LEDROW_ADDR_PORT    LATA    /**< uC port for Row address.*/
 #define LEDROW_ADDR_MASK    0x380   /**< Row address mask.*/
 #define LEDROW_ADDR_OFFSET  7       /**< Row address offset.*/
+#define LEDROW_ROWS         ((LEDROW_ADDR_MASK >> LEDROW_ADDR_OFFSET) + 1)  /**< Rows the address can select.*/
 
 void ledrow_init(void);
 void ledrow_switch(unsigned int);
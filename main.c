@@ -33,6 +33,21 @@
 #define CMD_RESET               0x0a
 #define CMD_GET_RC              0x0b
 #define CMD_SET_RC              0x0c
+#define CMD_SET_DISPLAY_MODE    0x0d
+#define CMD_SET_TRANSLATION     0x0e
+#define CMD_SET_GAMMA           0x0f
+#define CMD_SET_LAYER           0x10
+#define CMD_SET_OVERLAP         0x11
+#define CMD_GET_DISPLAY_STATS   0x12
+#define CMD_SET_EFFECT          0x13
+#define CMD_STAGE_ROUTE         0x14
+#define CMD_CROSSFADE           0x15
+#define CMD_ADD_HOLDS           0x16
+#define CMD_BEGIN_BATCH         0x17
+#define CMD_COMMIT_BATCH        0x18
+#define CMD_CLEAR_ROUTES        0x19
+#define CMD_SET_RAW_MODE        0x1a
+#define CMD_GET_TOUCH_STATS     0x1b
 
 #define CMD_SEND_BRIGHTNESS     0x04
 #define CMD_SEND_HOLD           0x05
@@ -40,20 +55,33 @@
 #define CMD_SEND_TOUCHMAP       0x07
 #define CMD_SEND_RAWTOUCH       0x09
 #define CMD_SEND_RC             0x0b
+#define CMD_SEND_TRANSLATION    0x0e
+#define CMD_SEND_DISPLAY_STATS  0x12
+#define CMD_SEND_TOUCH_STATS    0x1b
 
 #define CMD_BUFFER_SIZE         120
-#define TOUCHTX_BUFFER_SIZE     45
+#define TOUCHTX_EVENT_COUNT     16      /**< Touch event ring entries, a power of 2. */
+
+/** Touch event, queued by the touch callbacks for the main loop to send. */
+typedef struct {
+    unsigned char channel;  /**< Touch channel. */
+    unsigned char level;    /**< RC level of a press. */
+    unsigned char press;    /**< 1 for a press, 0 for a release. */
+    unsigned int time;      /**< Touch scan count at the event. */
+} touchtx_event;
 
 extern unsigned char usb_device_state;
 
 static unsigned int atoi(char *);
 static unsigned int atoi_next(char *, unsigned char *);
 static void putuchar_cdc(unsigned char, unsigned char);
+static void putuint_cdc(unsigned int, unsigned char);
 static void command_process(void);
 static void rawtouch_cb(unsigned int);
 static void rawrelease_cb(unsigned int);
 static void gethold_cb(unsigned int);
-static void rawtouch_send(unsigned char, unsigned int);
+static void touchtx_put(unsigned char, unsigned int);
+static void touchtx_send(void);
 
 void USBSuspend(void);
 
@@ -61,10 +89,20 @@ static unsigned char cmd_bufferfree = 1;    /**< Buffer ready flag. */
 static unsigned char cmd_bufferindex = 0;   /**< Present position in buffer. */
 static unsigned char cmd_processflag = 0;   /**< Flag that a command is ready for processing. */
 static char cmd_buffer[CMD_BUFFER_SIZE];    /**< Command buffer. */
-
-static unsigned char touchtx_count = 0;     /**< Bytes in tx buffer. */
-static char touchtx_buffer[TOUCHTX_BUFFER_SIZE];    /**< Transmit buffer. */
-static unsigned int touchtx_miss = 0;   /**< Events missed due to full buffer. */
+static unsigned char cmd_rawframe = 0;      /**< Receiving a binary raw display frame. */
+
+/* The touch events pass to the main loop through a single producer, single
+ * consumer ring.  Presses are queued from the ADC interrupt, when
+ * touch_process_rc() has its 64 samples, and releases from
+ * touch_process_samples() in the main loop.  The touch scan runs only one
+ * of the two at a time, so they never queue at once.  Only the callbacks
+ * move the head, and only the main loop moves the tail, so neither side
+ * disables interrupts. */
+static volatile touchtx_event touchtx_ring[TOUCHTX_EVENT_COUNT]; /**< Event ring. */
+static volatile unsigned char touchtx_head = 0; /**< Next entry to write, free running. */
+static volatile unsigned char touchtx_tail = 0; /**< Next entry to send, free running. */
+static volatile unsigned int touchtx_overruns = 0;  /**< Events dropped on a full ring. */
+static unsigned int touchtx_reported = 0;   /**< Overruns already reported. */
 
 /** Main function. 
  * 
@@ -76,8 +114,8 @@ int main(int argc, char** argv) {
     ledrow_init();
     ledcol_init();
     touch_init();
-    display_init();
     nvm_init();
+    display_init();
     touchmap_init();
 
     ledcol_enable();
@@ -109,27 +147,24 @@ int main(int argc, char** argv) {
         if (cmd_processflag)
             command_process();
 
-        if (touchtx_count) {
-            char lbuf[TOUCHTX_BUFFER_SIZE];
-            int i, count;
-
-            __builtin_disi(0x3fff);
-            for (i = 0; i < touchtx_count; i++)
-                lbuf[i] = touchtx_buffer[i];
-
-            count = touchtx_count;
-            touchtx_count = 0;
-            __builtin_disi(0);
-
-            for (i = 0; i < count; i++)
-                putc_cdc(lbuf[i]);
+        if (touchtx_tail != touchtx_head) {
+            do
+                touchtx_send();
+            while (touchtx_tail != touchtx_head);
 
             CDC_Flush_In_Now();
         }
 
         if (cmd_bufferfree)
             while (poll_getc_cdc(&RecvdByte)) {
-                if (RecvdByte == '\n') {
+                if (cmd_rawframe) {     // binary frame, until it is complete
+                    cmd_rawframe = !display_rawput(RecvdByte);
+                }
+                else if (RecvdByte == DISPLAY_RAW_SYNC || RecvdByte == DISPLAY_DELTA_SYNC) {
+                    display_rawstart(RecvdByte == DISPLAY_DELTA_SYNC);
+                    cmd_rawframe = 1;
+                }
+                else if (RecvdByte == '\n') {
                     cmd_buffer[cmd_bufferindex] = 0;
                     cmd_bufferfree = 0;
                     cmd_bufferindex = 0;
@@ -143,6 +178,9 @@ int main(int argc, char** argv) {
                 }
                 // TODO: Add some form of error if the command overflows the buffer.
             }
+
+        if (cmd_rawframe && display_rawtimeout())  // host stopped mid frame, back to commands
+            cmd_rawframe = 0;
     }
 
     return 0;
@@ -197,78 +235,133 @@ static void putuchar_cdc(unsigned char num, unsigned char trail) {
     putc_cdc(trail);
 }
 
-/** Create data packet for a touch/release event. */
-static void rawtouch_send(unsigned char touchrelease, unsigned int channel) {
-    if (TOUCHTX_BUFFER_SIZE - touchtx_count < 10) {
-        touchtx_miss++;
+/** Convert a uint to string and transmit it. */
+static void putuint_cdc(unsigned int num, unsigned char trail) {
+    char digits[5];
+    int i = 0;
+
+    do {
+        digits[i++] = num % 10 + '0';
+        num /= 10;
+    } while (num);
+
+    while (i)
+        putc_cdc(digits[--i]);
+    putc_cdc(trail);
+}
+
+/** Queue a touch/release event.
+ * Called from the touch callbacks, the only producer of the ring.  A press
+ * is queued from the ADC interrupt and a release from touch_process(), but
+ * never both at once.  The entry is written before the head moves past it.
+ * If the ring is full, the event is dropped and counted.
+ */
+static void touchtx_put(unsigned char press, unsigned int channel) {
+    unsigned char head = touchtx_head;
+    volatile touchtx_event *event;
+
+    if ((unsigned char)(head - touchtx_tail) == TOUCHTX_EVENT_COUNT) {
+        touchtx_overruns++;
         return;
     }
-    
-    touchtx_buffer[touchtx_count++] = CMD_SEND_RAWTOUCH / 10 + '0';
-    touchtx_buffer[touchtx_count++] = CMD_SEND_RAWTOUCH % 10 + '0';
-    touchtx_buffer[touchtx_count++] = ' ';
-    touchtx_buffer[touchtx_count++] = touchrelease;
-    touchtx_buffer[touchtx_count++] = ' ';
-    touchtx_buffer[touchtx_count++] = (channel & 0x1F) / 10 + '0';
-    touchtx_buffer[touchtx_count++] = (channel & 0x1F) % 10 + '0';
-    touchtx_buffer[touchtx_count++] = ' ';
-    touchtx_buffer[touchtx_count++] = ((channel & 0xE0) >> 5) + '0';
-    touchtx_buffer[touchtx_count++] = '\n';
+
+    event = &touchtx_ring[head & (TOUCHTX_EVENT_COUNT - 1)];
+    event->channel = channel & 0x1F;
+    event->level = (channel & 0xE0) >> 5;
+    event->press = press;
+    event->time = touch_scancount();
+
+    touchtx_head = head + 1;
+}
+
+/** Send the oldest queued touch event.
+ * Called from the main loop, the only consumer of the ring.  The entry is
+ * formatted before the tail releases it to the producer.
+ */
+static void touchtx_send(void) {
+    unsigned char tail = touchtx_tail;
+    volatile touchtx_event *event = &touchtx_ring[tail & (TOUCHTX_EVENT_COUNT - 1)];
+
+    putc_cdc(CMD_SEND_RAWTOUCH / 10 + '0');
+    putc_cdc(CMD_SEND_RAWTOUCH % 10 + '0');
+    putc_cdc(' ');
+    putc_cdc(event->press + '0');
+    putc_cdc(' ');
+    putc_cdc(event->channel / 10 + '0');
+    putc_cdc(event->channel % 10 + '0');
+    putc_cdc(' ');
+    putc_cdc(event->level + '0');
+    putc_cdc(' ');
+    putuint_cdc(event->time, '\n');
+
+    touchtx_tail = tail + 1;
 }
 
 /** Touch press event callback. */
 static void rawtouch_cb(unsigned int channel) {
-    rawtouch_send('1', channel);
+    touchtx_put(1, channel);
 }
 
 /** Touch release event callback. */
 static void rawrelease_cb(unsigned int channel) {
-    rawtouch_send('0', channel);
+    touchtx_put(0, channel);
 }
 
-/** GetHold functionality callback. */
+/** GetHold functionality callback.
+ * Called from touchmap_process() once the hold is chosen.  That call is
+ * commented out of the main loop for now, so CMD_GET_HOLD gets no answer
+ * until it is restored.
+ */
 static void gethold_cb(unsigned int hold) {
-    if (TOUCHTX_BUFFER_SIZE - touchtx_count < 7) {
-        touchtx_miss++;
-        return;
-    }
-
-    touchtx_buffer[touchtx_count++] = CMD_SEND_HOLD / 10 + '0';
-    touchtx_buffer[touchtx_count++] = CMD_SEND_HOLD % 10 + '0';
-    touchtx_buffer[touchtx_count++] = ' ';
-    touchtx_buffer[touchtx_count++] = hold / 100 + '0';
-    touchtx_buffer[touchtx_count++] = hold / 10 % 10 + '0';
-    touchtx_buffer[touchtx_count++] = hold % 10 + '0';
-    touchtx_buffer[touchtx_count++] = '\n';
+    putc_cdc(CMD_SEND_HOLD / 10 + '0');
+    putc_cdc(CMD_SEND_HOLD % 10 + '0');
+    putc_cdc(' ');
+    putc_cdc(hold / 100 + '0');
+    putc_cdc(hold / 10 % 10 + '0');
+    putc_cdc(hold % 10 + '0');
+    putc_cdc('\n');
+    CDC_Flush_In_Now();
 }
 
 /** Process command from serial interface. */
 void command_process(void) {
     const __psv__ unsigned char *nvmdata;
     unsigned char cmd;
-    unsigned char r, g, b;
+    unsigned char r, g, b, w;
     unsigned char levels[TOUCH_RC_LEVEL_COUNT];
+    unsigned char ppos[CMD_BUFFER_SIZE / 2];
     char *cpos = cmd_buffer;
     route newroute;
+    display_stats stats;
     int i, j;
 
     cpos += atoi_next(cpos, &cmd);
 
     switch (cmd) {
         case CMD_SHOW_ROUTE:    // send route to display controller.
+        case CMD_STAGE_ROUTE:   // or stage it for the next scene.
             i = 0;
 
             cpos += atoi_next(cpos, &newroute.id);
-            cpos += atoi_next(cpos, &newroute.len);
+            cpos += atoi_next(cpos, &w);    // hold count, the display counts the holds itself
             cpos += atoi_next(cpos, &newroute.r);
             cpos += atoi_next(cpos, &newroute.g);
             cpos += atoi_next(cpos, &newroute.b);
             cpos += atoi_next(cpos, &newroute.heartbeat);
-            
-            while (*cpos != '\0' && i < DISPLAY_ROUTE_LEN)
-                cpos += atoi_next(cpos, &newroute.holds[i++]);
 
-            display_showroute(&newroute);
+            for (j = 0; j < DISPLAY_HOLD_WORDS; j++)
+                newroute.holds[j] = 0;
+
+            while (*cpos != '\0' && i++ < CMD_BUFFER_SIZE / 2) {
+                cpos += atoi_next(cpos, &w);
+                if (w < DISPLAY_HOLDS)
+                    DISPLAY_HOLD_SET(newroute.holds, w);
+            }
+
+            if (cmd == CMD_SHOW_ROUTE)
+                display_showroute(&newroute);
+            else
+                display_stageroute(&newroute);
             break;
 
         case CMD_HIDE_ROUTE:    // hide route in display controller.
@@ -323,6 +416,108 @@ void command_process(void) {
 
             break;
 
+        case CMD_SET_DISPLAY_MODE:  // select PWM, BCM or scaled BCM frame generation
+            display_setmode(atoi(cpos));
+            break;
+
+        case CMD_SET_TRANSLATION:   // store part of the hold translation table
+            cpos += atoi_next(cpos, &r);
+
+            i = 0;
+            while (*cpos != '\0' && i < CMD_BUFFER_SIZE / 2)
+                cpos += atoi_next(cpos, &ppos[i++]);
+
+            r = display_settranslation(r, i, ppos);
+
+            putc_cdc(CMD_SEND_TRANSLATION / 10 + '0');
+            putc_cdc(CMD_SEND_TRANSLATION % 10 + '0');
+            putc_cdc(' ');
+            putc_cdc(r + '0');      // 1 if the table maps two holds together
+            putc_cdc('\n');
+            CDC_Flush_In_Now();
+            break;
+
+        case CMD_SET_GAMMA:         // store the color curve for one channel
+            cpos += atoi_next(cpos, &r);
+
+            i = 0;
+            while (*cpos != '\0' && i < DISPLAY_GAMMA_POINTS)
+                cpos += atoi_next(cpos, &ppos[i++]);
+
+            if (i == DISPLAY_GAMMA_POINTS)
+                display_setgamma(r, ppos);
+            break;
+
+        case CMD_SET_LAYER:         // set layer and blend mode of a route
+            cpos += atoi_next(cpos, &r);
+            cpos += atoi_next(cpos, &g);
+            cpos += atoi_next(cpos, &b);
+
+            display_setlayer(r, g, b);
+            break;
+
+        case CMD_SET_OVERLAP:       // flash or composite shared holds
+            display_setoverlap(atoi(cpos));
+            break;
+
+        case CMD_SET_EFFECT:        // animate a route on the device
+            cpos += atoi_next(cpos, &r);
+            cpos += atoi_next(cpos, &g);
+            cpos += atoi_next(cpos, &b);
+            cpos += atoi_next(cpos, &w);
+
+            display_seteffect(r, g, b, w);
+            break;
+
+        case CMD_CROSSFADE:         // fade to the staged routes
+            display_crossfade(atoi(cpos));
+            break;
+
+        case CMD_ADD_HOLDS:         // add holds that did not fit in one route command
+            cpos += atoi_next(cpos, &r);
+
+            i = 0;
+            while (*cpos != '\0' && i < CMD_BUFFER_SIZE / 2)
+                cpos += atoi_next(cpos, &ppos[i++]);
+
+            display_addholds(r, ppos, i);
+            break;
+
+        case CMD_BEGIN_BATCH:       // hold route edits until the commit
+            display_beginbatch();
+            break;
+
+        case CMD_COMMIT_BATCH:      // show the held edits together
+            display_commitbatch();
+            break;
+
+        case CMD_CLEAR_ROUTES:      // hide every displayed route
+            display_clearroutes();
+            break;
+
+        case CMD_SET_RAW_MODE:      // show raw frames, or go back to routes
+            display_setraw(atoi(cpos));
+            break;
+
+        case CMD_GET_DISPLAY_STATS: // send display timing statistics
+            display_getstats(&stats);
+
+            putc_cdc(CMD_SEND_DISPLAY_STATS / 10 + '0');
+            putc_cdc(CMD_SEND_DISPLAY_STATS % 10 + '0');
+            putc_cdc(' ');
+
+            putuint_cdc(stats.misses, ' ');
+            putuint_cdc(stats.frame_rate, ' ');
+            putuint_cdc(stats.scan_rate, ' ');
+            putuint_cdc(stats.isr_peak, ' ');
+            putuint_cdc(stats.isr_avg, ' ');
+            putuint_cdc(stats.process_peak, ' ');
+            putuint_cdc(stats.process_avg, ' ');
+            putuint_cdc(stats.saturated, '\n');
+            CDC_Flush_In_Now();
+
+            break;
+
         case CMD_GET_HOLD:  // solicit hold input from the user
             touchmap_gethold(gethold_cb);
             break;
@@ -333,13 +528,13 @@ void command_process(void) {
             putc_cdc(' ');
 
             putuchar_cdc(DISPLAY_MAX_ROUTES, ' ');
-            putuchar_cdc(DISPLAY_ROUTE_LEN, '\n');
+            putuint_cdc(DISPLAY_HOLDS, '\n');    // 256 on the largest panel, past a byte
             CDC_Flush_In_Now();
 
             break;
 
         case CMD_GET_TOUCHMAP:  // send touch->hold map
-            nvmdata = (const __psv__ unsigned char *)nvm_read(0);
+            nvmdata = (const __psv__ unsigned char *)nvm_read(NVM_TOUCHMAP_OFFSET);
 
             putc_cdc(CMD_SEND_TOUCHMAP / 10 + '0');
             putc_cdc(CMD_SEND_TOUCHMAP % 10 + '0');
@@ -347,7 +542,7 @@ void command_process(void) {
 
             for (i = 0; i < DISPLAY_ROWS; i++) {
                 for (j = 0; j < DISPLAY_COLS; j++)
-                    putuchar_cdc(nvmdata[i * DISPLAY_ROWS + j], ' ');
+                    putuchar_cdc(nvmdata[i * DISPLAY_COLS + j], ' ');
                 if (i == DISPLAY_ROWS - 1)
                     putc_cdc('\n');
                 CDC_Flush_In_Now();
@@ -359,6 +554,18 @@ void command_process(void) {
             touchmap_train();
             break;
 
+        case CMD_GET_TOUCH_STATS:   // send touch events dropped since the last read
+            j = touchtx_overruns - touchtx_reported;
+            touchtx_reported += j;
+
+            putc_cdc(CMD_SEND_TOUCH_STATS / 10 + '0');
+            putc_cdc(CMD_SEND_TOUCH_STATS % 10 + '0');
+            putc_cdc(' ');
+            putuint_cdc(j, '\n');
+            CDC_Flush_In_Now();
+
+            break;
+
         case CMD_RAW_TOUCH_MODE:    // enter raw touch mode to relay events over serial
             touch_setcallbacks(rawtouch_cb, rawrelease_cb);
             touch_enable();
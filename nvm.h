@@ -19,6 +19,15 @@ extern "C" {
 #define NVM_DATA_SIGLOC     511     /**< Location of validity signature in NVM block.*/
 #define NVM_DATA_SIGNATURE  0x3a9d  /**< Data signature value.*/
 
+/* Section sizes follow the display geometry, so these are only used where
+ * display.h is included. */
+#define NVM_TOUCHMAP_OFFSET 0       /**< Location of the touch channel map, one byte per hold.*/
+#define NVM_TOUCHMAP_SIGLOC (NVM_TOUCHMAP_OFFSET + DISPLAY_HOLDS / 2)  /**< Location of touch channel map signature.*/
+#define NVM_XLATE_OFFSET    (NVM_TOUCHMAP_SIGLOC + 1)  /**< Location of the hold translation table, one byte per hold.*/
+#define NVM_XLATE_SIGLOC    (NVM_XLATE_OFFSET + DISPLAY_HOLDS / 2)     /**< Location of translation table signature.*/
+#define NVM_GAMMA_OFFSET    (NVM_XLATE_SIGLOC + 1)     /**< Location of the color curve control points.*/
+#define NVM_GAMMA_SIGLOC    (NVM_GAMMA_OFFSET + (3 * DISPLAY_GAMMA_POINTS + 1) / 2)  /**< Location of color curve signature.*/
+
 void nvm_init(void);
 int nvm_valid(void);
 void nvm_program(unsigned int, unsigned int, unsigned int *);
@@ -15,7 +15,7 @@ static void filter_reset(void);
 static void touch_nextsample(void);
 static void touch_nextchannel(void);
 static void touch_interval_delay(void);
-static void touch_process_samples(void);
+static unsigned int touch_process_samples(void);
 static void touch_process_rc(void);
 
 /** Const array that contains touch channel->peripheral mapping information. */
@@ -51,6 +51,9 @@ static volatile unsigned int * const tris[3] = {&TRISA, &TRISB, &TRISC};
 static unsigned int enabled = 0;        /**< Touch enabled flag. */
 static unsigned int shutting_down = 0;  /**< Shutdown process flag. */
 static unsigned int active_channel = 0; /**< Active touch channel. */
+static unsigned int scan_pos = 0;       /**< Position of the active channel in scan_order. */
+static unsigned int amux_sel;           /**< AMUX position selected, TOUCH_AMUX_COUNT if unknown. */
+static unsigned char scan_order[TOUCH_CHANNEL_COUNT];   /**< Channels in sense order, grouped by AMUX position. */
 static unsigned int long_delay = 0;     /**< Long delay flag. */
 static unsigned int short_delay = 0;    /**< Short delay flag. */
 static unsigned int delay = 0;          /**< Any delay flag. */
@@ -58,6 +61,8 @@ static unsigned int delay = 0;          /**< Any delay flag. */
 static unsigned int touch_process_flag;       /**< Samples need processing Flag.*/
 
 static unsigned int avg_depth;      /**< Depth of accumulated average. */
+static unsigned int quiet_scans;    /**< Scans since a channel last crossed the activity threshold. */
+static unsigned int scan_count;     /**< Scans processed, free running. */
 static unsigned int samples[TOUCH_CHANNEL_COUNT];   /**< Most recent samples. */
 static unsigned int p2samples[TOUCH_CHANNEL_COUNT];
 static unsigned int sampleavg[TOUCH_CHANNEL_COUNT];
@@ -65,7 +70,6 @@ static unsigned int basecount[TOUCH_CHANNEL_COUNT]; /**< Base capacitance count.
 static unsigned int p2basecount[TOUCH_CHANNEL_COUNT];
 static unsigned int threshold_count[TOUCH_CHANNEL_COUNT];   /**< Count of consecutive threshold triggers. */
 static unsigned int subthreshold_count[TOUCH_CHANNEL_COUNT];
-static unsigned int sample_count;
 static unsigned int temp_samples[6];
 static unsigned int temp_depth;
 
@@ -85,6 +89,13 @@ static void (*release_cb)(unsigned int);    /**< Release event callback pointer.
  * Configure Timer1, and the ADC for touch sensing.
  */
 void touch_init(void) {
+    unsigned int a, i, n = 0;
+
+    for (a = 0; a < TOUCH_AMUX_COUNT; a++)  // channels sharing an AMUX position scan together
+        for (i = 0; i < TOUCH_CHANNEL_COUNT; i++)
+            if (cmatrix[i].amux == a)
+                scan_order[n++] = i;
+
     TMR1 = 0;                   // configure timer
     PR1 = TOUCH_TIME_CONSTANT;
     _TCKPS = TOUCH_TIME_PRESCALER;
@@ -106,13 +117,15 @@ void touch_init(void) {
     _CTMUIP = TOUCH_CTMU_PRIORITY;
 
     // ADC configuration
-    _SSRC = 0;                  // CTMU triggers conversion
+    _SSRC = 7;                  // sample counter ends sampling and starts conversion
     _CH0SA = 1;                 // set default input to a grounded touch channel
     _ADON = 0;
-    _ADCS = 5; //39;                 // tAD = tCY(ADCS + 1); tCY = tOSC/2
+    _ADCS = TOUCH_ADC_CLOCK;    // tAD = tCY(ADCS + 1); tCY = tOSC/2
     _AD1IP = TOUCH_ADC_PRIORITY;    // TODO: determine proper interrupt priority, should be low prio
-    _SMPI = 0;
-    _SAMC = 0;
+    _SMPI = TOUCH_BURST_SAMPLES;    // interrupt after the precharge and the burst
+    _SAMC = TOUCH_SAMPLE_TIME;
+    _BUFM = 0;                  // one 16 word buffer
+    _ASAM = 0;
 
     press_cb = NULL;
     release_cb = NULL;
@@ -169,7 +182,9 @@ void touch_enable(void) {
     filter_reset();
 
     enabled = 1;
-    active_channel = TOUCH_CHANNEL_COUNT - 1;
+    scan_pos = TOUCH_CHANNEL_COUNT - 1;
+    active_channel = scan_order[scan_pos];
+    amux_sel = TOUCH_AMUX_COUNT;
 
     temp_depth = 0;
     for (i = 0; i < 6; i++)
@@ -203,16 +218,24 @@ void touch_disable(void) {
     __builtin_disi(0);
 }
 
+/** Ground the last channel, and select the next one.
+ * The ADC converts the channel while it is still grounded, which empties
+ * the sample and hold capacitor and fills ADC1BUF0.  Switching the AMUX
+ * connects the electrodes of every muxed pin at the new position to their
+ * grounded pins, so only the first channel of each position waits for the
+ * discharge.  The rest of its group discharged meanwhile, and only wait for
+ * the channel to settle.  A channel sensed again for RC detection was just
+ * charged, and always waits for the discharge.
+ */
 static void touch_nextchannel(void) {
     int i;
 
-    sample_count = 0;
-
     if (!rc_detect) {
         prev_chan = cmatrix[active_channel];
         //prev_chan = cmatrix[0];
 
-        active_channel = (active_channel + 1) % TOUCH_CHANNEL_COUNT;
+        scan_pos = (scan_pos + 1) % TOUCH_CHANNEL_COUNT;
+        active_channel = scan_order[scan_pos];
 
         //active_channel = 0;
         cur_chan = cmatrix[active_channel];
@@ -228,13 +251,18 @@ static void touch_nextchannel(void) {
         Nop();
 
     _CH0SA = cur_chan.aindex;   // switch ADC channel
-    _SAMP = 1;
+    _ADON = 1;
+    _SAMP = 1;                  // precharge conversion, the burst follows in ADC1BUF1
 
 //    if (rc_detect) {
         delay = short_delay = 1;
         TMR1 = 0;       // reset timer count
         _TCKPS = TOUCH_DISCHARGE_PRESCALER;
-        PR1 = TOUCH_DISCHARGE_DELAY;
+        if (rc_detect || cur_chan.amux != amux_sel)
+            PR1 = TOUCH_DISCHARGE_DELAY;
+        else
+            PR1 = TOUCH_SETTLE_DELAY;
+        amux_sel = cur_chan.amux;
         _TON = 1;
         return;
 //    }
@@ -243,19 +271,18 @@ static void touch_nextchannel(void) {
 }
 
 /** Start the sense on the next touch channel.
- * Configures the next channel, and starts a sense.
+ * Enables the current source and the ADC auto sampling together.  The ADC
+ * then takes the whole burst of conversions on its own, TOUCH_SAMPLE_TIME
+ * apart, and interrupts once at the end.
  */
 static void touch_nextsample(void) {
     RMBITW(*(tris[cur_chan.port]), cur_chan.pindex, 1);     // set pin to input
 
-    TMR1 = 0;       // reset timer count
-    PR1 = TOUCH_TIME_CONSTANT;
-    _TCKPS = TOUCH_TIME_PRESCALER;
     _IDISSEN = 0;   // disable current source override grounder
 
     __builtin_disi(0x3fff); // disable interrupts for critical timing
     _EDG1STAT = 1;          // enable current source
-    _TON = 1;               // enable timer
+    _ASAM = 1;              // start the burst
     __builtin_disi(0);      // re-enable interrupts
 }
 
@@ -286,9 +313,10 @@ void touch_process(void) {
         return;
     }
 
-    touch_process_samples();
-            
-    if (avg_depth == TOUCH_AVG_DEPTH)   // if average is stable, long delay
+    if (touch_process_samples())            // an RC sense already started the next sample
+        return;
+
+    if (avg_depth == TOUCH_AVG_DEPTH && quiet_scans >= TOUCH_QUIET_SCANS)  // if average is stable and idle, long delay
         touch_interval_delay();
     else
         touch_nextchannel();                   // average isn't ready, get more samples
@@ -297,13 +325,27 @@ void touch_process(void) {
 /** Process a batch of touch samples.
  * This function handles touch detection, calls callbacks, and maintains the
  * base level average.  It should be called each time a batch of samples has
- * been taken.
+ * been taken.  Any channel past the activity threshold keeps the scans
+ * running back to back, until TOUCH_QUIET_SCANS scans pass without one, so
+ * the debounce scans of a press or release do not wait for the long delay.
+ *
+ * The averages are running sums TOUCH_AVG_DEPTH samples deep, so every
+ * scale is a shift.  A channel's baseline follows drift only while that
+ * channel is below the activity threshold, so a hand held on one hold does
+ * not stop the rest of the wall from adapting.
+ *
+ * A new touch starts an RC sense, which schedules the next sample itself.
+ * The caller must not schedule another one, or a second conversion lands
+ * in the burst and misaligns the sample buffer.
+ * @return 1 if the next sample has already been started, otherwise 0.
  */
-static void touch_process_samples(void) {
-    unsigned int thresh_exceeded = 0;
+static unsigned int touch_process_samples(void) {
+    unsigned int active = 0;
     unsigned int i;
     unsigned int avg, savg;
 
+    scan_count++;
+
     if (avg_depth < TOUCH_AVG_DEPTH) {      // accumulate baseline before detecting touch
         for (i = 0; i < TOUCH_CHANNEL_COUNT; i++) {
             basecount[i] += samples[i];
@@ -311,15 +353,21 @@ static void touch_process_samples(void) {
             sampleavg[i] += samples[i];
         }
         avg_depth++;
-        return;
+        return 0;
     }
 
     for (i = 0; i < TOUCH_CHANNEL_COUNT; i++) {     // touch detection
-        sampleavg[i] += (samples[i] << 2) - sampleavg[i] / (avg_depth >> 2);
-        savg = sampleavg[i] / avg_depth;
-        avg = basecount[i] / TOUCH_AVG_DEPTH;
+        sampleavg[i] += (samples[i] << (TOUCH_AVG_SHIFT - TOUCH_FILTER_SHIFT)) - (sampleavg[i] >> TOUCH_FILTER_SHIFT);
+        savg = sampleavg[i] >> TOUCH_AVG_SHIFT;
+        avg = basecount[i] >> TOUCH_AVG_SHIFT;
+        if (avg > savg && (avg - savg) > TOUCH_ACTIVE_THRESHOLD) {
+            active = 1;
+        } else {            // no finger near this channel, track its drift
+            basecount[i] += samples[i] - (basecount[i] >> TOUCH_AVG_SHIFT);
+            p2basecount[i] += p2samples[i] - (p2basecount[i] >> TOUCH_AVG_SHIFT);
+        }
+
         if (avg > savg && (avg - savg) > TOUCH_DETECT_THRESHOLD) {
-            thresh_exceeded++;
             threshold_count[i]++;
             if (threshold_count[i] == TOUCH_HYST_COUNT) {  // soft debounc
                 rc_detect = 1;
@@ -340,21 +388,16 @@ static void touch_process_samples(void) {
                 threshold_count[i] = 0;
     }
 
-    if (!thresh_exceeded)   // if no finger is near, apply current sample to average
-        for (i = 0; i < TOUCH_CHANNEL_COUNT; i++) {
-            if (samples[i] > basecount[i] / avg_depth)
-                basecount[i]++;
-            else
-                basecount[i]--;
-            
-            if (p2samples[i] > p2basecount[i] / avg_depth)
-                p2basecount[i]++;
-            else
-                p2basecount[i]--;
-        }
+    if (active)
+        quiet_scans = 0;
+    else if (quiet_scans < TOUCH_QUIET_SCANS)
+        quiet_scans++;
+
+    if (!rc_detect)
+        return 0;
 
-    if (rc_detect)
-        touch_process_rc();
+    touch_process_rc();
+    return 1;
 }
 
 static void touch_process_rc(void) {
@@ -401,6 +444,7 @@ static void filter_reset(void) {
     int i;
     
     avg_depth = 0;
+    quiet_scans = TOUCH_QUIET_SCANS;
     for (i = 0; i < TOUCH_CHANNEL_COUNT; i++) {
         samples[i] = 0;
         sampleavg[i] = 0;
@@ -413,41 +457,40 @@ static void filter_reset(void) {
 }
 
 /** ADC Interrupt Service Routine.
- * Handles the completion of a touch sense.  The ADC is automatically triggered
- * by the CTMU after the current pulse.  This handler stores the result in the
- * sample buffer.  After every channel has been sampled, it will call the
- * processing handler.  If we have a stable baseline, it will trigger a long
- * delay, otherwise it will start the next sample.
+ * Handles the completion of a touch sense.  The ADC fills its buffer with
+ * the precharge conversion and the whole burst, and interrupts once.  This
+ * handler stores the result in the sample buffer.  After every channel has
+ * been sampled, it will call the processing handler.  If we have a stable
+ * baseline, it will trigger a long delay, otherwise it will start the next
+ * sample.
  */
 void __attribute__((interrupt, auto_psv)) _ADC1Interrupt(void) {
-    _AD1IF = 0;
+    unsigned int last, second;
 
-    if (sample_count < 5) {
-        _SAMP = 1;
-        temp_samples[sample_count++] = ADC1BUF0;
-        Nop(); Nop(); Nop(); Nop(); Nop(); Nop(); Nop(); Nop(); Nop(); Nop();
-        _SAMP = 0;
-        return;
-    }
-//    _SAMP = 0;
+    _ASAM = 0;          // end the burst
+    _AD1IF = 0;
 
     _IDISSEN = 1;
 
     _EDG2STAT = 0;
     _EDG1STAT = 0;
 
+    second = ADC1BUF2;
+    last = ADC1BUF6;
+    _ADON = 0;          // drop the conversion auto sampling started, rewind the buffer
+
     //SET_CPU_IPL(0);
-    temp_samples[sample_count] += ADC1BUF0;
+    temp_samples[TOUCH_BURST_SAMPLES - 1] += last;
     temp_depth++;
 
-    samples[active_channel] = ADC1BUF0;
-    p2samples[active_channel] = temp_samples[1];
+    samples[active_channel] = last;
+    p2samples[active_channel] = second;
 
     if (rc_detect) {
 //        unsigned int avg = basecount[rc_i] / TOUCH_AVG_DEPTH;
 //        if (avg > samples[rc_i] && (avg - samples[rc_i]) > TOUCH_DETECT_THRESHOLD) {
-            rc_avgs[0] += temp_samples[1];
-            rc_avgs[1] += ADC1BUF0;
+            rc_avgs[0] += second;
+            rc_avgs[1] += last;
             rc_samplecount++;
  //       }
     }
@@ -465,7 +508,7 @@ void __attribute__((interrupt, auto_psv)) _ADC1Interrupt(void) {
         return;
     }
 
-    if (active_channel == TOUCH_CHANNEL_COUNT - 1)  // sampled every channel
+    if (scan_pos == TOUCH_CHANNEL_COUNT - 1)    // sampled every channel
         touch_process_flag = 1;
     else 
         touch_nextchannel();
@@ -477,19 +520,15 @@ void __attribute__((interrupt, auto_psv)) _CTMUInterrupt(void) {
 }
 
 /** Timer1 Interrupt Service Routine.
- * Handles the end of the long sampling delay.  It shuts off the timer,
- * and reconfigures it for generating the touch current pulse.
+ * Handles the end of the discharge delay, and of the long sampling delay.
+ * It shuts off the timer, and starts the next sense or flags processing.
  */
 void __attribute__((interrupt, auto_psv)) _T1Interrupt(void) {
     _T1IF = 0;
     _TON = 0;   // disable timer
 
-    if (!delay) {
-//        _EDG2STAT = 0;
-//        _EDG1STAT = 0;
-        _SAMP = 0;
+    if (!delay)
         return;
-    }
 
     if (short_delay) {
         delay = short_delay = 0;
@@ -523,4 +562,12 @@ void touch_getrclevels(unsigned char *levels) {
 
     for (i = 0; i < TOUCH_RC_LEVEL_COUNT; i++)
         levels[i] = rc_levels[i];
-}
\ No newline at end of file
+}
+
+/** Get the touch scan count.
+ * Counts processed scans and wraps freely.  Touch events use it as their
+ * timestamp.
+ */
+unsigned int touch_scancount(void) {
+    return scan_count;
+}
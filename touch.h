@@ -24,14 +24,28 @@ extern "C" {
 #define TOUCH_TIME_CONSTANT     60
 #define TOUCH_TIME_PRESCALER    0       /**< Current pulse prescaler. 1:1. */
 
+#define TOUCH_ADC_CLOCK         5       /**< ADC clock, tAD = tCY(TOUCH_ADC_CLOCK + 1). */
+#define TOUCH_BURST_SAMPLES     6       /**< Conversions while the current source charges a channel. */
+/** Auto sample time before each conversion, in tAD.  The first conversion
+ * ends the current pulse duration after the current source is enabled. */
+#define TOUCH_SAMPLE_TIME       (TOUCH_TIME_CONSTANT / (TOUCH_ADC_CLOCK + 1))
+/** Delay before sensing a channel that is already discharged.  Covers the
+ * precharge conversion, 12 tAD plus the sample time. */
+#define TOUCH_SETTLE_DELAY      ((TOUCH_SAMPLE_TIME + 14) * (TOUCH_ADC_CLOCK + 1))
+
 #define TOUCH_DISCHARGE_DELAY       3200    /**< Delay to zero touch channel. */
 #define TOUCH_DISCHARGE_PRESCALER   0
+#define TOUCH_AMUX_COUNT            4       /**< AMUX select positions. */
 
 #define TOUCH_SAMPLING_DELAY    19000   /**< Long delay between samples. */
 #define TOUCH_DELAY_PRESCALER   1       /**< Long delay prescaler. 8:1. */
 
 #define TOUCH_DETECT_THRESHOLD  100     /**< Touch detection threshold. */
-#define TOUCH_AVG_DEPTH         32      /**< Depth of baseline value average. */
+#define TOUCH_ACTIVE_THRESHOLD  (TOUCH_DETECT_THRESHOLD / 2)    /**< Activity threshold, scans run back to back. */
+#define TOUCH_QUIET_SCANS       16      /**< Scans without activity before the long delay returns. */
+#define TOUCH_AVG_SHIFT         5       /**< Baseline fixed point, log2 of its depth. */
+#define TOUCH_AVG_DEPTH         (1 << TOUCH_AVG_SHIFT)  /**< Depth of baseline value average. */
+#define TOUCH_FILTER_SHIFT      3       /**< Sample average moves 1/8 of the way each scan. */
 
 #define TOUCH_ADC_PRIORITY      6       /**< ADC interrupt priority. */
 #define TOUCH_TIMER_PRIORITY    6       /**< Timer1 interrupt priority. */
@@ -56,6 +70,7 @@ void touch_disable(void);
 void touch_process(void);
 void touch_setrclevels(unsigned char[]);
 void touch_getrclevels(unsigned char *);
+unsigned int touch_scancount(void);
 
 
 #ifdef	__cplusplus
@@ -38,17 +38,26 @@ void touchmap_init(void) {
     gethold_state = STATE_IDLE;
 }
 
-/** Populate touch_channel -> hold map. */
+/** Populate touch_channel -> hold map.
+ * The map is only used once it has been trained, as the NVM block is also
+ * written when other tables are stored.
+ */
 static void populate_channels(void) {
+    const __psv__ unsigned int *nvmsig;
     const __psv__ unsigned char *nvmdata;
 
     memset(channels, 0, sizeof(channels));
-    if (nvm_valid()) {      // populate touch_channel map
+    nvmsig = nvm_read(NVM_TOUCHMAP_SIGLOC);
+    if (nvmsig && *nvmsig == NVM_DATA_SIGNATURE) {  // populate touch_channel map
         int i;
-        nvmdata = (const __psv__ unsigned char *) nvm_read(0);
+        nvmdata = (const __psv__ unsigned char *) nvm_read(NVM_TOUCHMAP_OFFSET);
         for (i = 0; i < DISPLAY_COLS*DISPLAY_ROWS; i++) {
-            touch_channel *temp = &channels[nvmdata[i]];
-            temp->holds[temp->count++] = i;
+            touch_channel *temp;
+            if (nvmdata[i] >= TOUCH_CHANNEL_COUNT)  // hold was never trained
+                continue;
+            temp = &channels[nvmdata[i]];
+            if (temp->count < TOUCHMAP_MAX_HOLDS_PER_CHANNEL)
+                temp->holds[temp->count++] = i;
         }
     }
 }
@@ -75,8 +84,8 @@ static void touchmap_gethold_releasecb(unsigned int chan) {
  * @param cb Function to call when once the hold is selected.
  */
 void touchmap_gethold(void (*cb)(unsigned int)) {
+    memset(&gethold_route, 0, sizeof(route));
     gethold_route.id = 254;
-    gethold_route.len = 1;
     gethold_route.r = 255;
     gethold_route.g = 255;
     gethold_route.b = 255;
@@ -106,7 +115,8 @@ void touchmap_process(void) {
                 gethold_index = 0;
 
                 // display first hold on the channel
-                gethold_route.holds[0] = channels[gethold_channel].holds[gethold_index];
+                memset(gethold_route.holds, 0, sizeof(gethold_route.holds));
+                DISPLAY_HOLD_SET(gethold_route.holds, channels[gethold_channel].holds[gethold_index]);
                 display_showroute(&gethold_route);
 
                 TMR4 = 0;
@@ -128,7 +138,8 @@ void touchmap_process(void) {
                 display_hideroute(gethold_route.id);
                 gethold_index++;
                 gethold_index %= channels[gethold_channel].count;
-                gethold_route.holds[0] = channels[gethold_channel].holds[gethold_index];
+                memset(gethold_route.holds, 0, sizeof(gethold_route.holds));
+                DISPLAY_HOLD_SET(gethold_route.holds, channels[gethold_channel].holds[gethold_index]);
                 display_showroute(&gethold_route);
             }
             break;
@@ -152,10 +163,10 @@ void touchmap_train(void) {
     route disphold;
     unsigned int i;
     unsigned int tchan;
-    unsigned char map[DISPLAY_ROWS][DISPLAY_COLS];
+    unsigned int map[DISPLAY_HOLDS / 2 + 1];    // map and signature are written together
 
+    memset(&disphold, 0, sizeof(route));
     disphold.id = 254;  // route to display the holds.
-    disphold.len = 1;
     disphold.r = 255;
     disphold.g = 255;
     disphold.b = 255;
@@ -166,7 +177,8 @@ void touchmap_train(void) {
     touch_enable();
 
     for (i = 0; i < DISPLAY_COLS * DISPLAY_ROWS; i++) { // loop through the holds
-        disphold.holds[0] = i;
+        memset(disphold.holds, 0, sizeof(disphold.holds));
+        DISPLAY_HOLD_SET(disphold.holds, i);
 
         // TODO: do we need to enable/disable display when changing routes?
         display_showroute(&disphold);
@@ -179,12 +191,13 @@ void touchmap_train(void) {
         touched = 0;
         __builtin_disi(0);
 
-        map[i >> 4][i & 0xF] = tchan;
+        ((unsigned char *)map)[i] = tchan;
 
         display_hideroute(disphold.id);
     }
 
-    nvm_program(sizeof(map) >> 1, 0, (unsigned int *)map);
+    map[DISPLAY_HOLDS / 2] = NVM_DATA_SIGNATURE;
+    nvm_program(DISPLAY_HOLDS / 2 + 1, NVM_TOUCHMAP_OFFSET, map);
 
     populate_channels();
 }